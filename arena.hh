@@ -0,0 +1,134 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Per-fiber arenas.
+//
+//   auto h = spawn({.arena_size = 64 * 1024}, [] {
+//       std::pmr::vector<std::pmr::string> parts(fiber_memory_resource());
+//       ...
+//   });
+//
+// A fiber spawned with fiber_config::arena_size gets a fiber_arena, a
+// std::pmr::memory_resource that bumps a pointer through slabs of that size
+// taken from the thread's stack_pool, whose size classes recycle them
+// between fibers. Nothing is freed one allocation at a time: all the slabs
+// go back to the pool together when the fiber is reclaimed, after its entry
+// function has returned. Allocating takes no lock and touches nothing
+// another thread uses, and a request handled by one fiber is freed with a
+// few pointer writes per slab.
+//
+// Whatever lives in the arena must be gone by the time the fiber is, e.g.
+// a result handed to join() must not be allocated there.
+
+#pragma once
+
+#include "context.hh"
+#include "stack.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+class fiber_arena final : public std::pmr::memory_resource {
+  // At the bottom of every slab.
+  struct slab {
+    stack_ptr memory;
+    slab* next;
+  };
+
+  slab* _slabs; // newest first; the oldest holds the fiber_arena itself
+  char* _next;  // free space in the newest slab
+  char* _end;
+  size_t _slab_size;
+  size_t _allocated = 0;
+
+  fiber_arena(slab* first, char* next, char* end, size_t slab_size)
+      : _slabs(first), _next(next), _end(end), _slab_size(slab_size) {}
+
+public:
+  struct deleter {
+    void operator()(fiber_arena* a) const noexcept { destroy(a); }
+  };
+
+  // Builds an arena at the bottom of its first slab.
+  static std::unique_ptr<fiber_arena, deleter> create(size_t slab_size) {
+      auto s = new_slab(slab_size);
+      auto at = align_up(reinterpret_cast<char*>(s + 1), alignof(fiber_arena));
+      auto end = reinterpret_cast<char*>(s) + s->memory.get_deleter().size;
+      auto a = new (at) fiber_arena(s, at + sizeof(fiber_arena), end, slab_size);
+      return std::unique_ptr<fiber_arena, deleter>(a);
+  }
+
+  // Releases every slab, the arena's own among them.
+  static void destroy(fiber_arena* a) noexcept {
+      auto s = a->_slabs;
+      a->~fiber_arena();
+      while (s) {
+          auto next = s->next;
+          auto memory = std::move(s->memory);
+          s->~slab();
+          s = next;
+      }
+  }
+
+  fiber_arena(const fiber_arena&) = delete;
+  fiber_arena& operator=(const fiber_arena&) = delete;
+
+  // Bytes handed out, including alignment padding.
+  size_t allocated() const { return _allocated; }
+
+private:
+  static char* align_up(char* p, size_t align) {
+      return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(align - 1));
+  }
+
+  static slab* new_slab(size_t size) {
+      auto memory = make_stack(size);
+      auto base = memory.get();
+#ifdef FIBER_ASAN
+      // Slabs come from the stack pool: see jmp_buf_link::initialize().
+      __asan_unpoison_memory_region(base, memory.get_deleter().size);
+#endif
+      return new (base) slab{std::move(memory), nullptr};
+  }
+
+  void* do_allocate(size_t bytes, size_t align) override {
+      auto p = align_up(_next, align);
+      if (p > _end || bytes > size_t(_end - p)) [[unlikely]] {
+          p = refill(bytes, align);
+      }
+      _allocated += p + bytes - _next;
+      _next = p + bytes;
+      return p;
+  }
+
+  // Freed with the whole arena.
+  void do_deallocate(void*, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource& x) const noexcept override {
+      return this == &x;
+  }
+
+  // Starts a new slab, big enough for the allocation when a regular one
+  // is not. What was left of the previous one is given up.
+  char* refill(size_t bytes, size_t align) {
+      auto needed = sizeof(slab) + align + bytes;
+      auto s = new_slab(std::max(_slab_size, needed));
+      s->next = _slabs;
+      _slabs = s;
+      _next = reinterpret_cast<char*>(s + 1);
+      _end = reinterpret_cast<char*>(s) + s->memory.get_deleter().size;
+      return align_up(_next, align);
+  }
+};
+
+// The running fiber's arena; the default resource when it has none.
+inline std::pmr::memory_resource* fiber_memory_resource() {
+    if (auto a = g_current_context->arena) {
+        return a;
+    }
+    return std::pmr::get_default_resource();
+}
@@ -0,0 +1,347 @@
+// Fiber microbenchmarks.
+//
+// make bench && ./bench [output] [fibers,...], or by hand:
+// g++ -O2 -Wall -std=c++20 bench.cc -lfmt -o bench
+//
+// Every benchmark times single operations with the CPU cycle counter and
+// reports the p50/p99/p999 latency in ns and cycles. Besides the table on
+// stdout each benchmark writes one JSON object per line to output
+// (bench_output.txt by default), so that two builds can be compared.
+//
+//  - roundtrip.*: main context -> fiber -> main context, with each context
+//    backend directly and through jmp_buf_link::enter()/leave().
+//  - create.setup: make_stack() + setup() of a fiber, which only makes it
+//    ready; it runs, parks and releases its stack between samples.
+//  - create.spawn, create.spawn_bulk: a fan-out of 64 fibers that return
+//    at once, with spawn() one by one and with one spawn_bulk(); both put
+//    the handles into one reused vector. One sample is the cost of creating
+//    one fiber, averaged over the fan-out. The fibers run and release their
+//    stacks between samples.
+//  - lifecycle.spawn, lifecycle.spawn_bulk: the same fan-outs timed end to
+//    end: creation, running to completion, reclaiming the frames and
+//    stacks, and joining every fiber; one sample is one fiber's lifetime.
+//  - lifecycle.bulk_arena: the same with an arena per fiber whose
+//    slabs come from the stack size class the fibers' stacks do. The pool
+//    keeps enough idle stacks for both.
+//  - yield.N: N fibers yielding to each other through the scheduler; one
+//    sample is one switch, averaged over a full round of all N fibers.
+//    The fiber counts default to 2, 1000 and 1000000.
+
+#include "context.hh"
+#include "fiber.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+using namespace fmt;
+
+// The TSC on x86_64; the generic timer, which ticks slower than the core,
+// on aarch64.
+inline uint64_t cycles() {
+#if defined(__x86_64__)
+    unsigned aux;
+    return __rdtscp(&aux);
+#elif defined(__aarch64__)
+    uint64_t v;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#endif
+}
+
+struct clock_calibration {
+  double cycles_per_ns;
+  double overhead; // cycles of back-to-back cycles() calls
+
+  static clock_calibration measure() {
+      clock_calibration c;
+      auto t0 = chrono::steady_clock::now();
+      auto c0 = cycles();
+      this_thread::sleep_for(chrono::milliseconds(100));
+      auto c1 = cycles();
+      auto t1 = chrono::steady_clock::now();
+      c.cycles_per_ns = (c1 - c0) / chrono::duration<double, nano>(t1 - t0).count();
+
+      vector<double> samples(10000);
+      for (auto& s : samples) {
+          auto a = cycles();
+          s = cycles() - a;
+      }
+      nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+      c.overhead = samples[samples.size() / 2];
+      return c;
+  }
+};
+
+static clock_calibration g_clock;
+static FILE* g_output;
+
+// Cycles per operation, one entry per sample.
+using samples = vector<double>;
+
+double percentile(samples& s, double p) {
+    auto i = min(s.size() - 1, size_t(p * s.size()));
+    nth_element(s.begin(), s.begin() + i, s.end());
+    return s[i];
+}
+
+void report(const string& name, samples&& s) {
+    double sum = 0;
+    for (auto& x : s) {
+        sum += x;
+    }
+    auto mean = sum / s.size();
+    auto p50 = percentile(s, 0.50);
+    auto p99 = percentile(s, 0.99);
+    auto p999 = percentile(s, 0.999);
+    auto ns = [] (double c) { return c / g_clock.cycles_per_ns; };
+
+    print("{:<24} {:>9} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.0f} {:>9.0f} {:>9.0f}\n",
+          name, s.size(), ns(mean), ns(p50), ns(p99), ns(p999), p50, p99, p999);
+    print(g_output, "{{\"bench\": \"{}\", \"samples\": {}, \"mean_ns\": {:.2f}, "
+          "\"p50_ns\": {:.2f}, \"p99_ns\": {:.2f}, \"p999_ns\": {:.2f}, "
+          "\"p50_cycles\": {:.0f}, \"p99_cycles\": {:.0f}, \"p999_cycles\": {:.0f}}}\n",
+          name, s.size(), ns(mean), ns(p50), ns(p99), ns(p999), p50, p99, p999);
+    fflush(stdout);
+    fflush(g_output);
+}
+
+// Times one operation, net of the cost of reading the clock.
+template <typename Func>
+double timed(Func&& func) {
+    auto c0 = cycles();
+    func();
+    auto c1 = cycles();
+    return max(0.0, double(c1 - c0) - g_clock.overhead);
+}
+
+template <typename Context>
+struct roundtrip_bench {
+  static inline typename Context::state main_ctx;
+  static inline typename Context::state fiber_ctx;
+
+  static void fiber_main(void*) {
+      MAKE_FRAME();
+      while (true) {
+          Context::swap(fiber_ctx, main_ctx);
+      }
+  }
+
+  static samples run(size_t iterations) {
+      const size_t stack_size = 4 * 4096;
+      auto stack = make_stack(stack_size);
+
+      Context::prepare(fiber_ctx, stack.get(), stack_size, &fiber_main, nullptr);
+      Context::swap(main_ctx, fiber_ctx);
+
+      for (size_t i = 0; i < iterations / 10; i++) {
+          Context::swap(main_ctx, fiber_ctx);
+      }
+
+      samples s(iterations);
+      for (auto& x : s) {
+          x = timed([] { Context::swap(main_ctx, fiber_ctx); });
+      }
+      return s;
+  }
+};
+
+void leave_forever(void* arg) {
+    MAKE_FRAME();
+    auto link = static_cast<jmp_buf_link*>(arg);
+    while (true) {
+        link->leave();
+    }
+}
+
+samples enter_leave_bench(size_t iterations) {
+    const size_t stack_size = 4 * 4096;
+    auto stack = make_stack(stack_size);
+    jmp_buf_link ctx;
+    ctx.initialize(&leave_forever, &ctx, stack.get(), stack_size);
+    ctx.begin();
+
+    for (size_t i = 0; i < iterations / 10; i++) {
+        ctx.enter();
+    }
+
+    samples s(iterations);
+    for (auto& x : s) {
+        x = timed([&] { ctx.enter(); });
+    }
+    return s;
+}
+
+void park_at_once(void*) {
+    MAKE_FRAME();
+    scheduler::local().park();
+    abort();
+}
+
+samples create_bench(size_t iterations) {
+    const size_t stack_size = 4 * 4096;
+    samples s(iterations);
+    jmp_buf_link ctx;
+    for (auto& x : s) {
+        stack_ptr stack;
+        x = timed([&] {
+            stack = make_stack(stack_size);
+            setup(&ctx, stack.get(), stack_size, &park_at_once);
+        });
+        scheduler::local().run();
+    }
+    return s;
+}
+
+// With Joined, the timed part goes on until every fiber has finished, been
+// reclaimed and joined.
+template <bool Bulk, bool Joined = false, bool Arena = false>
+samples fan_out_bench(size_t iterations) {
+    const size_t fan_out = 64;
+    const fiber_config config{.stack_size = 4 * 4096, .arena_size = Arena ? 4 * 4096 : 0};
+    samples s(iterations);
+    if constexpr (Arena) {
+        stack_pool::local().configure({.max_idle_per_class = 2 * fan_out});
+    }
+    vector<join_handle<void>> handles;
+    handles.reserve(fan_out);
+    for (auto& x : s) {
+        x = timed([&] {
+            if constexpr (Bulk) {
+                spawn_bulk(config, fan_out, [] (size_t) {}, handles);
+            } else {
+                for (size_t i = 0; i < fan_out; i++) {
+                    handles.push_back(spawn(config, [] {}));
+                }
+            }
+            if constexpr (Joined) {
+                scheduler::local().run();
+                for (auto& h : handles) {
+                    h.join();
+                }
+                handles.clear();
+            }
+        }) / fan_out;
+        scheduler::local().run();
+        handles.clear();
+    }
+    if constexpr (Arena) {
+        stack_pool::local().configure({});
+    }
+    return s;
+}
+
+struct yield_bench {
+  static inline size_t rounds_left;
+  static inline bool stop;
+  static inline uint64_t last;
+  static inline samples* out;
+  static inline size_t fibers;
+
+  static void first_fiber(void*) {
+      MAKE_FRAME();
+      auto& sched = scheduler::local();
+      sched.yield();
+      last = cycles();
+      while (rounds_left--) {
+          sched.yield();
+          auto now = cycles();
+          out->push_back(max(0.0, double(now - last) - g_clock.overhead) / fibers);
+          last = now;
+      }
+      stop = true;
+      sched.park();
+  }
+
+  static void other_fiber(void*) {
+      MAKE_FRAME();
+      auto& sched = scheduler::local();
+      while (!stop) {
+          sched.yield();
+      }
+      sched.park();
+  }
+
+  // The stacks are packed into one mapping: a million page-aligned stacks
+  // would cost a page each, and a million guarded ones more mappings than
+  // vm.max_map_count allows.
+  static samples run(size_t n, size_t rounds) {
+      const size_t stack_size = 2048;
+      samples s;
+      s.reserve(rounds);
+      out = &s;
+      fibers = n;
+      rounds_left = rounds;
+      stop = false;
+
+      auto arena_size = n * stack_size;
+      auto arena = static_cast<char*>(mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+      throw_system_error_on(arena == MAP_FAILED, "mmap");
+      vector<jmp_buf_link> ctx(n);
+      for (size_t i = 0; i < n; i++) {
+          setup(&ctx[i], arena + i * stack_size, stack_size, i == 0 ? &first_fiber : &other_fiber);
+      }
+      scheduler::local().run();
+      munmap(arena, arena_size);
+      return s;
+  }
+};
+
+int main(int argc, char** argv) {
+    const char* output = argc > 1 ? argv[1] : "bench_output.txt";
+    vector<size_t> fiber_counts = {2, 1000, 1000000};
+    if (argc > 2) {
+        fiber_counts.clear();
+        for (char* p = argv[2]; *p; ) {
+            fiber_counts.push_back(strtoull(p, &p, 10));
+            if (*p == ',') {
+                p++;
+            }
+        }
+    }
+
+    g_output = fopen(output, "w");
+    if (!g_output) {
+        perror(output);
+        return 1;
+    }
+
+    init();
+    g_clock = clock_calibration::measure();
+    print("cycle counter: {:.3f} cycles/ns, {:.0f} cycles overhead\n\n", g_clock.cycles_per_ns, g_clock.overhead);
+    print("{:<24} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9}\n",
+          "benchmark", "samples", "mean ns", "p50 ns", "p99 ns", "p999 ns", "p50 cyc", "p99 cyc", "p999 cyc");
+
+    const size_t iterations = 1'000'000;
+    report(format("roundtrip.{}", setjmp_context::name), roundtrip_bench<setjmp_context>::run(iterations));
+    report(format("roundtrip.{}", asm_context::name), roundtrip_bench<asm_context>::run(iterations));
+    report("roundtrip.enter_leave", enter_leave_bench(iterations));
+    report("create.setup", create_bench(iterations / 10));
+    report("create.spawn", fan_out_bench<false>(iterations / 1000));
+    report("create.spawn_bulk", fan_out_bench<true>(iterations / 1000));
+    report("lifecycle.spawn", fan_out_bench<false, true>(iterations / 1000));
+    report("lifecycle.spawn_bulk", fan_out_bench<true, true>(iterations / 1000));
+    report("lifecycle.bulk_arena", fan_out_bench<true, true, true>(iterations / 1000));
+
+    for (auto n : fiber_counts) {
+        auto rounds = max<size_t>(20, 20'000'000 / n);
+        report(format("yield.{}", n), yield_bench::run(n, rounds));
+    }
+
+    fclose(g_output);
+    return 0;
+}
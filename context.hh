@@ -0,0 +1,737 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Fiber execution contexts.
+//
+// A suspended fiber is described by the state its context backend saves on
+// a switch. Two backends are available:
+//
+//  - setjmp_context goes through libc setjmp()/longjmp(). It saves more than
+//    a switch needs and, depending on the libc, also mangles pointers, checks
+//    shadow stacks or touches the signal mask.
+//  - asm_context saves the callee-saved registers and the stack pointer with
+//    a few instructions of hand-written assembly (x86_64 and aarch64).
+//    Floating-point control state (MXCSR, x87 CW, FPCR) is considered
+//    thread-wide and is not switched.
+//
+// jmp_buf_link uses asm_context by default. Build with
+// -DFIBER_CONTEXT_SETJMP to select the libc backend instead.
+//
+// Either way a new fiber starts from a frame built directly on its stack by
+// make_initial_frame(), so creating one makes no system call and its entry
+// function takes a plain void* argument.
+//
+// With asm_context a context may also run on a shared_stack that others
+// take turns on ("copy stack"): its frames stay on the stack while nobody
+// else needs it and are copied off, from the saved stack pointer up, when
+// another context is switched to that does, and copied back before it is
+// switched to again. A parked context then costs only the few hundred
+// bytes it really has live. The copies are made on the stack of whatever
+// context does the switch, which therefore must not run on the same shared
+// stack: contexts of one shared stack never switch to each other directly.
+// Nothing outside may point into the frames of such a context while it is
+// switched out either; what the library's own waits keep around for the
+// waker lives in a pinned<T>, which is on the heap for these contexts.
+//
+// Under AddressSanitizer or ThreadSanitizer every switch tells the runtime
+// about it (__sanitizer_start/finish_switch_fiber, __tsan_switch_to_fiber),
+// so that ASan tracks the stack in use and its fake stacks and TSan keeps a
+// separate happens-before history per fiber. Without a sanitizer the hooks
+// are empty inline functions and the switch path is the same code.
+
+#pragma once
+
+#include "counters.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <memory>
+#include <new>
+#include <optional>
+#include <setjmp.h>
+#include <type_traits>
+#include <utility>
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FIBER_ASAN 1
+#endif
+#if __has_feature(thread_sanitizer)
+#define FIBER_TSAN 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) && !defined(FIBER_ASAN)
+#define FIBER_ASAN 1
+#endif
+#if defined(__SANITIZE_THREAD__) && !defined(FIBER_TSAN)
+#define FIBER_TSAN 1
+#endif
+
+#ifdef FIBER_ASAN
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+#ifdef FIBER_TSAN
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "fiber contexts are only implemented for x86_64 and aarch64"
+#endif
+
+// fiber_swap_context() pushes the callee-saved registers onto the current
+// stack, stores the stack pointer into *from_sp, loads to_sp and pops the
+// registers saved there by a previous call, returning into whoever made it.
+//
+// fiber_start_trampoline is where the first switch into a frame built by
+// make_initial_frame() returns to. It calls the entry function found in the
+// restored registers with its argument and, when that returns, ends the
+// fiber through fiber_finish().
+//
+// Both live in COMDAT sections so that every translation unit that includes
+// this header may emit them.
+extern "C" void fiber_swap_context(void** from_sp, void* to_sp);
+extern "C" void fiber_start_trampoline();
+extern "C" [[noreturn]] void fiber_finish();
+
+#if defined(__x86_64__)
+asm(R"(
+    .pushsection .text.fiber_swap_context,"axG",@progbits,fiber_swap_context,comdat
+    .globl fiber_swap_context
+    .type fiber_swap_context,@function
+    .p2align 4
+fiber_swap_context:
+    .cfi_startproc
+    pushq %rbp
+    .cfi_adjust_cfa_offset 8
+    pushq %rbx
+    .cfi_adjust_cfa_offset 8
+    pushq %r12
+    .cfi_adjust_cfa_offset 8
+    pushq %r13
+    .cfi_adjust_cfa_offset 8
+    pushq %r14
+    .cfi_adjust_cfa_offset 8
+    pushq %r15
+    .cfi_adjust_cfa_offset 8
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    .cfi_adjust_cfa_offset -8
+    popq %r14
+    .cfi_adjust_cfa_offset -8
+    popq %r13
+    .cfi_adjust_cfa_offset -8
+    popq %r12
+    .cfi_adjust_cfa_offset -8
+    popq %rbx
+    .cfi_adjust_cfa_offset -8
+    popq %rbp
+    .cfi_adjust_cfa_offset -8
+    ret
+    .cfi_endproc
+    .size fiber_swap_context, .-fiber_swap_context
+    .popsection
+
+    .pushsection .text.fiber_start_trampoline,"axG",@progbits,fiber_start_trampoline,comdat
+    .globl fiber_start_trampoline
+    .type fiber_start_trampoline,@function
+    .p2align 4
+fiber_start_trampoline:
+    .cfi_startproc
+    .cfi_undefined rip
+    movq %r13, %rdi
+    callq *%r12
+    callq fiber_finish@PLT
+    ud2
+    .cfi_endproc
+    .size fiber_start_trampoline, .-fiber_start_trampoline
+    .popsection
+)");
+#elif defined(__aarch64__)
+asm(R"(
+    .pushsection .text.fiber_swap_context,"axG",@progbits,fiber_swap_context,comdat
+    .globl fiber_swap_context
+    .type fiber_swap_context,%function
+    .p2align 4
+fiber_swap_context:
+    .cfi_startproc
+    sub sp, sp, #0xa0
+    .cfi_adjust_cfa_offset 0xa0
+    stp x19, x20, [sp, #0x00]
+    stp x21, x22, [sp, #0x10]
+    stp x23, x24, [sp, #0x20]
+    stp x25, x26, [sp, #0x30]
+    stp x27, x28, [sp, #0x40]
+    stp x29, x30, [sp, #0x50]
+    stp d8,  d9,  [sp, #0x60]
+    stp d10, d11, [sp, #0x70]
+    stp d12, d13, [sp, #0x80]
+    stp d14, d15, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0x00]
+    ldp x21, x22, [sp, #0x10]
+    ldp x23, x24, [sp, #0x20]
+    ldp x25, x26, [sp, #0x30]
+    ldp x27, x28, [sp, #0x40]
+    ldp x29, x30, [sp, #0x50]
+    ldp d8,  d9,  [sp, #0x60]
+    ldp d10, d11, [sp, #0x70]
+    ldp d12, d13, [sp, #0x80]
+    ldp d14, d15, [sp, #0x90]
+    add sp, sp, #0xa0
+    .cfi_adjust_cfa_offset -0xa0
+    ret
+    .cfi_endproc
+    .size fiber_swap_context, .-fiber_swap_context
+    .popsection
+
+    .pushsection .text.fiber_start_trampoline,"axG",@progbits,fiber_start_trampoline,comdat
+    .globl fiber_start_trampoline
+    .type fiber_start_trampoline,%function
+    .p2align 4
+fiber_start_trampoline:
+    .cfi_startproc
+    .cfi_undefined x30
+    mov x0, x20
+    blr x19
+    bl fiber_finish
+    brk #0
+    .cfi_endproc
+    .size fiber_start_trampoline, .-fiber_start_trampoline
+    .popsection
+)");
+#endif
+
+// Lays out on the stack [stack_bottom, stack_bottom + stack_size) the
+// registers fiber_swap_context() pops, so that switching to the returned
+// stack pointer runs func(arg) with an empty call chain.
+inline void* make_initial_frame(void* stack_bottom, size_t stack_size, void (*func)(void*), void* arg) {
+    auto top = (reinterpret_cast<uintptr_t>(stack_bottom) + stack_size) & ~uintptr_t(15);
+#if defined(__x86_64__)
+    // r15, r14, r13, r12, rbx, rbp, return address; the trampoline's call
+    // then sees the stack aligned the way the ABI wants it.
+    auto frame = reinterpret_cast<uintptr_t*>(top) - 7;
+    frame[0] = 0;
+    frame[1] = 0;
+    frame[2] = reinterpret_cast<uintptr_t>(arg);
+    frame[3] = reinterpret_cast<uintptr_t>(func);
+    frame[4] = 0;
+    frame[5] = 0;
+    frame[6] = reinterpret_cast<uintptr_t>(&fiber_start_trampoline);
+#elif defined(__aarch64__)
+    // x19..x30, d8..d15
+    auto frame = reinterpret_cast<uintptr_t*>(top) - 20;
+    for (size_t i = 0; i < 20; i++) {
+        frame[i] = 0;
+    }
+    frame[0] = reinterpret_cast<uintptr_t>(func);
+    frame[1] = reinterpret_cast<uintptr_t>(arg);
+    frame[11] = reinterpret_cast<uintptr_t>(&fiber_start_trampoline);
+#endif
+    return frame;
+}
+
+struct setjmp_context {
+  struct state {
+    jmp_buf jmpbuf;
+    void* initial_sp = nullptr; // set until the first switch into the context
+  };
+
+  static constexpr const char* name = "setjmp";
+
+  static void prepare(state& s, void* stack_bottom, size_t stack_size, void (*func)(void*), void* arg) {
+      s.initial_sp = make_initial_frame(stack_bottom, stack_size, func, arg);
+  }
+
+  // Saves the current context into `from` and resumes `to`.
+  static void swap(state& from, state& to) {
+      if (setjmp(from.jmpbuf) == 0) {
+          jump(to);
+      }
+  }
+
+  // Resumes `to`, abandoning the current context.
+  [[noreturn]] static void jump(state& to) {
+      if (auto sp = std::exchange(to.initial_sp, nullptr)) {
+          void* discarded;
+          fiber_swap_context(&discarded, sp);
+      }
+      longjmp(to.jmpbuf, 1);
+  }
+};
+
+struct asm_context {
+  struct state {
+    void* sp;
+  };
+
+  static constexpr const char* name = "asm";
+
+  static void prepare(state& s, void* stack_bottom, size_t stack_size, void (*func)(void*), void* arg) {
+      s.sp = make_initial_frame(stack_bottom, stack_size, func, arg);
+  }
+
+  static void swap(state& from, state& to) {
+      fiber_swap_context(&from.sp, to.sp);
+  }
+
+  [[noreturn]] static void jump(state& to) {
+      void* discarded;
+      fiber_swap_context(&discarded, to.sp);
+      __builtin_unreachable();
+  }
+};
+
+#ifdef FIBER_CONTEXT_SETJMP
+using context_backend = setjmp_context;
+#else
+using context_backend = asm_context;
+#endif
+
+// Scheduling state of the fiber running on a context, see scheduler.hh.
+enum class fiber_state : uint8_t {
+  ready,     // queued to run
+  running,
+  suspended, // parked until woken
+  finished,
+};
+
+// Which ready queue a context goes into, see scheduler.hh.
+enum class fiber_class : uint8_t {
+  latency,    // latency-critical: run first
+  background, // run in the share of the scheduler left to them
+};
+
+// The C++ runtime keeps the exceptions being handled and the count behind
+// std::uncaught_exceptions() per thread (__cxa_eh_globals in the Itanium
+// ABI, laid out like this by libstdc++ and libc++abi). Fibers interleave
+// their catch blocks on one thread, so every context keeps its own copy and
+// a switch trades the thread's for the incoming context's: two words.
+struct eh_state {
+  void* caught_exceptions = nullptr;
+  unsigned int uncaught_exceptions = 0;
+};
+
+// Not inlined: __cxa_get_globals() is declared const, and a copy of its
+// result must not be carried across a switch onto a fiber that may resume
+// on another thread.
+[[gnu::noinline]] inline void switch_eh_state(eh_state& from, const eh_state& to) {
+    auto globals = reinterpret_cast<eh_state*>(abi::__cxa_get_globals());
+    from = *globals;
+    *globals = to;
+}
+
+// A context is cache-line aligned and whatever a switch or the scheduler
+// touches comes first: with asm_context all of it shares one line, so a
+// switch touches a line of each of the two contexts and nothing else of
+// them. Colder data, like the sanitizer state below or what fiber_frame
+// adds, goes after it.
+struct shared_stack;
+class fiber_arena;
+
+struct alignas(64) jmp_buf_link {
+  context_backend::state regs;
+  jmp_buf_link* link; // link to prev context
+  jmp_buf_link* next; // run queue hook
+  fiber_state state;
+  bool cancelled = false; // see scheduler::cancel()
+  fiber_class priority = fiber_class::latency;
+  bool requeued = false; // by work_stealing_scheduler::yield()
+  eh_state eh;
+  // Called once the context has finished and is no longer running on its
+  // stack, so that it may release the stack and whatever lives on it.
+  void (*reclaim)(jmp_buf_link*) = nullptr;
+  shared_stack* shared = nullptr; // when it runs on one, with asm_context
+  // End of the hot part.
+  char* saved = nullptr;          // its frames while off the shared stack
+  size_t saved_size = 0;
+  size_t saved_capacity = 0;
+  // Set by whoever made the context until it first runs: tears down what
+  // its entry function would have consumed, for a fiber cancelled before
+  // it ever ran, see scheduler::cancel().
+  void (*discard)(void*) = nullptr;
+  void* discard_arg = nullptr;
+  void** locals = nullptr; // fiber_local values, see fiber_local.hh
+  fiber_arena* arena = nullptr; // see arena.hh
+  // Orders its class's ready queue with scheduler_config::deadline_order.
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+#ifdef FIBER_ASAN
+  const void* stack_bottom = nullptr;
+  size_t stack_size = 0; // 0 for a thread's own stack until it is known
+  void* fake_stack = nullptr;
+  void (*entry)(void*) = nullptr;
+  void* entry_arg = nullptr;
+#endif
+#ifdef FIBER_TSAN
+  void* tsan_fiber = nullptr; // nullptr for a thread's own context until it switches
+#endif
+#ifdef FIBER_TRACE
+  const char* trace_name = nullptr; // fiber_config::name, see trace.hh
+  uint64_t trace_id = 0;            // in the order of initialize()
+#endif
+
+public:
+  void initialize(void (*func)(void*), void* arg, void* stack_bottom, size_t stack_size);
+  void begin();
+  void enter();
+  void leave();
+  void switch_to(jmp_buf_link& to);
+  [[noreturn]] void end();
+  // Called when reclaiming a finished context that ran on a shared stack.
+  void release_shared();
+
+private:
+  void make_resident(const jmp_buf_link& from);
+  void save_frames();
+  void reserve_saved(size_t size);
+};
+
+// Memory for the stack belongs to its owner; occupant is the context whose
+// frames are on it.
+struct shared_stack {
+  char* bottom = nullptr;
+  size_t size = 0;
+  jmp_buf_link* occupant = nullptr;
+
+  char* top() const {
+      return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(bottom) + size) & ~uintptr_t(15));
+  }
+};
+
+static_assert(!std::is_same_v<context_backend, asm_context>
+        || offsetof(jmp_buf_link, shared) + sizeof(jmp_buf_link::shared) <= 64,
+        "the hot part of jmp_buf_link must fit a cache line");
+
+inline thread_local jmp_buf_link g_unthreaded_context;
+inline thread_local jmp_buf_link* g_current_context;
+inline thread_local jmp_buf_link* g_previous_context;
+// g_current_context, looked up afresh. The compiler takes the address of a
+// thread_local to be the same for the whole of a function, so code inlined
+// into a fiber that may resume on another thread, on a
+// work_stealing_scheduler, must not read g_current_context directly.
+[[gnu::noinline]] inline jmp_buf_link* current_context() {
+    return g_current_context;
+}
+inline thread_local jmp_buf_link* g_finished_context; // not reclaimed yet
+// Watchdog ticks since the last switch on this thread, see watchdog.hh.
+inline thread_local std::atomic<unsigned> g_watchdog_ticks;
+
+// The slots of fiber_local.hh: one index per fiber_local, and per context
+// an array of max_fiber_locals values, allocated on its first access.
+constexpr size_t max_fiber_locals = 32;
+inline std::atomic<size_t> g_nr_fiber_locals{0};
+inline std::array<void (*)(void*), max_fiber_locals> g_fiber_local_destructors;
+
+// Destroys a context's fiber_local values, last registered first.
+inline void release_fiber_locals(jmp_buf_link& f) {
+    auto slots = f.locals;
+    if (!slots) [[likely]] {
+        return;
+    }
+    for (auto i = max_fiber_locals; i-- > 0; ) {
+        if (auto v = std::exchange(slots[i], nullptr)) {
+            g_fiber_local_destructors[i](v);
+        }
+    }
+    f.locals = nullptr;
+    std::free(slots);
+}
+
+// There is no caller of main() in this context. We need to annotate this frame like this so that
+// unwinders don't try to trace back past this frame.
+// See https://github.com/scylladb/scylla/issues/1909.
+#ifdef __x86_64__
+#define MAKE_FRAME() asm(".cfi_undefined rip");
+#elif defined(__PPC__)
+#define MAKE_FRAME() asm(".cfi_undefined lr");
+#elif defined(__aarch64__)
+#define MAKE_FRAME() asm(".cfi_undefined x30");
+#elif defined(__s390x__)
+#define MAKE_FRAME() asm(".cfi_undefined %r14");
+#else
+#define MAKE_FRAME() #warning "Backtracing threads may be broken"
+#endif
+
+inline void init() {
+    g_unthreaded_context.link = nullptr;
+    g_current_context = &g_unthreaded_context;
+    counters_registry::instance().add_this_thread();
+}
+
+// Called right before switching from `from`, or from a finishing context
+// when nullptr, to `to`.
+inline void sanitizer_start_switch([[maybe_unused]] jmp_buf_link* from, [[maybe_unused]] jmp_buf_link& to) {
+#ifdef FIBER_ASAN
+    g_previous_context = from;
+    __sanitizer_start_switch_fiber(from ? &from->fake_stack : nullptr, to.stack_bottom, to.stack_size);
+#endif
+#ifdef FIBER_TSAN
+    if (from && !from->tsan_fiber) {
+        from->tsan_fiber = __tsan_get_current_fiber();
+    }
+    __tsan_switch_to_fiber(to.tsan_fiber, 0);
+#endif
+}
+
+// Called in `self` right after switching to it.
+inline void sanitizer_finish_switch([[maybe_unused]] jmp_buf_link& self) {
+#ifdef FIBER_ASAN
+    const void* bottom;
+    size_t size;
+    __sanitizer_finish_switch_fiber(self.fake_stack, &bottom, &size);
+    // The first switch away from a thread's own stack tells its bounds.
+    if (auto from = g_previous_context; from && !from->stack_size) {
+        from->stack_bottom = bottom;
+        from->stack_size = size;
+    }
+#endif
+}
+
+// Called once a finished context is no longer running.
+inline void sanitizer_forget([[maybe_unused]] jmp_buf_link& f) {
+#ifdef FIBER_TSAN
+    __tsan_destroy_fiber(std::exchange(f.tsan_fiber, nullptr));
+#endif
+}
+
+#ifdef FIBER_ASAN
+// A new fiber has to finish the switch that started it before its entry
+// function runs.
+inline void sanitizer_entry(void* arg) {
+    MAKE_FRAME();
+    auto self = static_cast<jmp_buf_link*>(arg);
+    sanitizer_finish_switch(*self);
+    self->entry(self->entry_arg);
+}
+#endif
+
+inline void jmp_buf_link::initialize(void (*func)(void*), void* arg, void* stack_bottom, size_t stack_size) {
+#ifdef FIBER_ASAN
+    // A recycled stack still carries the poisoning of its last fiber.
+    __asan_unpoison_memory_region(stack_bottom, stack_size);
+    this->stack_bottom = stack_bottom;
+    this->stack_size = stack_size;
+    fake_stack = nullptr;
+    entry = func;
+    entry_arg = arg;
+    func = &sanitizer_entry;
+    arg = this;
+#endif
+#ifdef FIBER_TSAN
+    if (tsan_fiber) {
+        __tsan_destroy_fiber(tsan_fiber);
+    }
+    tsan_fiber = __tsan_create_fiber(0);
+#endif
+#ifdef FIBER_TRACE
+    trace_id = g_trace_ids.fetch_add(1, std::memory_order_relaxed) + 1;
+#endif
+#ifndef FIBER_CONTEXT_SETJMP
+    if (shared) {
+        // The initial frame has no pointers into itself: build it aside,
+        // it is copied onto the shared stack on the first switch.
+        constexpr size_t room = 256;
+        reserve_saved(room);
+        auto sp = static_cast<char*>(make_initial_frame(saved, room, func, arg));
+        saved_size = saved + room - sp;
+        std::memmove(saved, sp, saved_size);
+        regs.sp = shared->top() - saved_size;
+        return;
+    }
+#else
+    assert(!shared && "shared stacks need asm_context");
+#endif
+    context_backend::prepare(regs, stack_bottom, stack_size, func, arg);
+}
+
+// Puts this context's frames back on its shared stack, if it has one and
+// they are not there: called right before switching to it from `from`.
+inline void jmp_buf_link::make_resident([[maybe_unused]] const jmp_buf_link& from) {
+#ifndef FIBER_CONTEXT_SETJMP
+    auto s = shared;
+    if (!s || s->occupant == this) [[likely]] {
+        return;
+    }
+    assert(from.shared != s && "contexts of one shared stack cannot switch to each other");
+    if (auto o = s->occupant; o && o->state != fiber_state::finished) {
+        o->save_frames();
+    }
+#ifdef FIBER_ASAN
+    // The shadow still describes the previous occupant's frames.
+    __asan_unpoison_memory_region(s->bottom, s->size);
+#endif
+    std::memcpy(s->top() - saved_size, saved, saved_size);
+    s->occupant = this;
+#endif
+}
+
+inline void jmp_buf_link::save_frames() {
+#ifndef FIBER_CONTEXT_SETJMP
+    auto sp = static_cast<char*>(regs.sp);
+    size_t size = shared->top() - sp;
+    reserve_saved(size);
+#ifdef FIBER_ASAN
+    __asan_unpoison_memory_region(sp, size);
+#endif
+    std::memcpy(saved, sp, size);
+    saved_size = size;
+#endif
+}
+
+inline void jmp_buf_link::release_shared() {
+    if (shared->occupant == this) {
+        shared->occupant = nullptr;
+    }
+    std::free(std::exchange(saved, nullptr));
+    saved_size = saved_capacity = 0;
+}
+
+inline void jmp_buf_link::reserve_saved(size_t size) {
+    if (size <= saved_capacity) {
+        return;
+    }
+    auto capacity = std::max({size, saved_capacity * 2, size_t(256)});
+    // 16-byte aligned, as the initial frame needs.
+    auto p = static_cast<char*>(std::realloc(saved, capacity));
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    saved = p;
+    saved_capacity = capacity;
+}
+
+#ifdef FIBER_TRACE
+inline tracer::fiber_id trace_fiber_id(const jmp_buf_link* f) {
+    if (f == &g_unthreaded_context) {
+        return {};
+    }
+    return {f, f->trace_name, f->trace_id};
+}
+#endif
+
+// Traces an event of f, or a switch to it, see trace.hh.
+inline void fiber_trace([[maybe_unused]] trace_kind kind, [[maybe_unused]] const jmp_buf_link* f) {
+#ifdef FIBER_TRACE
+    trace_record(kind, trace_fiber_id(f));
+#endif
+}
+
+// Async-signal-safe once backtrace() has been called.
+inline void fiber_trace_stack_sample([[maybe_unused]] const jmp_buf_link* f) {
+#ifdef FIBER_TRACE
+    trace_record_stack_sample(trace_fiber_id(f));
+#endif
+}
+
+// The first switch into an initialized context; it starts running func(arg).
+inline void jmp_buf_link::begin() {
+    enter();
+}
+
+inline void jmp_buf_link::enter() {
+    auto prev = std::exchange(g_current_context, this);
+    link = prev;
+    make_resident(*prev);
+    switch_eh_state(prev->eh, eh);
+    g_counters.on_enter(prev != &g_unthreaded_context);
+    fiber_trace(trace_kind::enter, this);
+    g_watchdog_ticks.store(0, std::memory_order_relaxed);
+    sanitizer_start_switch(prev, *this);
+    context_backend::swap(prev->regs, regs);
+    sanitizer_finish_switch(*prev);
+    // end() always resumes the context that entered the chain of fibers
+    // the finished one belonged to, in here.
+    if (auto f = std::exchange(g_finished_context, nullptr)) {
+        sanitizer_forget(*f);
+        if (f->reclaim) {
+            f->reclaim(f);
+        }
+    }
+}
+
+inline void jmp_buf_link::leave() {
+    g_current_context = link;
+    link->make_resident(*this);
+    switch_eh_state(eh, link->eh);
+    g_counters.on_leave();
+    fiber_trace(trace_kind::leave, link);
+    g_watchdog_ticks.store(0, std::memory_order_relaxed);
+    sanitizer_start_switch(this, *link);
+    context_backend::swap(regs, g_current_context->regs);
+    sanitizer_finish_switch(*this);
+}
+
+// Transfers control from this, the current context, straight to `to`, which
+// takes over this context's link: when `to` leaves, it returns to whoever
+// entered this one.
+inline void jmp_buf_link::switch_to(jmp_buf_link& to) {
+    to.link = link;
+    g_current_context = &to;
+    to.make_resident(*this);
+    switch_eh_state(eh, to.eh);
+    g_counters.on_hand_off();
+    fiber_trace(trace_kind::hand_off, &to);
+    g_watchdog_ticks.store(0, std::memory_order_relaxed);
+    sanitizer_start_switch(this, to);
+    context_backend::swap(regs, to.regs);
+    sanitizer_finish_switch(*this);
+}
+
+// Leaves the context for good; the one resumed reclaims it.
+inline void jmp_buf_link::end() {
+    state = fiber_state::finished;
+    g_finished_context = this;
+    g_current_context = link;
+    link->make_resident(*this);
+    switch_eh_state(eh, link->eh);
+    g_counters.on_end();
+    fiber_trace(trace_kind::end, link);
+    g_watchdog_ticks.store(0, std::memory_order_relaxed);
+    sanitizer_start_switch(nullptr, *link);
+    context_backend::jump(g_current_context->regs);
+}
+
+// An object that others point to while the fiber that made it is switched
+// out, like what it waits on: in place, unless the fiber runs on a shared
+// stack, whose frames move in the meantime; then on the heap.
+template <typename T>
+class pinned {
+  std::optional<T> _inline;
+  std::unique_ptr<T> _heap;
+  T* _object;
+
+public:
+  template <typename... A>
+  explicit pinned(A&&... a) {
+      if (g_current_context && g_current_context->shared) [[unlikely]] {
+          _heap = std::make_unique<T>(std::forward<A>(a)...);
+          _object = _heap.get();
+      } else {
+          _object = &_inline.emplace(std::forward<A>(a)...);
+      }
+  }
+
+  pinned(const pinned&) = delete;
+  pinned& operator=(const pinned&) = delete;
+
+  T& operator*() const { return *_object; }
+  T* operator->() const { return _object; }
+};
+
+// Where a fiber's entry function returns to.
+extern "C" [[noreturn, gnu::used]] inline void fiber_finish() {
+    release_fiber_locals(*g_current_context);
+    g_current_context->end();
+}
+
@@ -0,0 +1,228 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// C++20 coroutines on the fiber scheduler.
+//
+//   co_task<int> fetch(int fd) {
+//       auto n = co_await spawn([fd] { return blocking_read(fd); });
+//       co_await reschedule();
+//       co_return n;
+//   }
+//
+// Coroutines are queued on the thread's scheduler next to its fibers: a
+// suspended coroutine that is woken goes into it as a coroutine_link, a
+// handle and a pointer, and run() resumes it on its own stack. Either side
+// can wait for the other:
+//
+//  - a coroutine co_awaits a fiber's join_handle, see fiber.hh;
+//  - a fiber join()s a co_task, parking until the coroutine has returned;
+//  - a coroutine co_awaits a co_task, resuming it by symmetric transfer.
+//
+// A co_task starts when it is first awaited or joined, running on the
+// stack of whoever does that until it first suspends, or when start()
+// queues it. Coroutine code runs on whatever stack resumes it, so it must
+// co_await rather than block: no join() or park() in a coroutine.
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+template <typename T>
+class co_task;
+
+// The result of a co_task and who waits for it.
+struct co_task_promise_base {
+  std::coroutine_handle<> continuation; // a coroutine awaiting it
+  jmp_buf_link* joiner = nullptr;      // a fiber joining it
+  std::exception_ptr exception;
+  coroutine_link link;               // for start()
+  bool started = false;
+  bool done = false;
+  bool detached = false; // the co_task is gone: destroy the frame when done
+
+  // Hands the result over to whoever waits for it.
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        auto& p = h.promise();
+        p.done = true;
+        if (p.detached) {
+            h.destroy();
+            return std::noop_coroutine();
+        }
+        if (p.joiner) {
+            scheduler::local().wake(*p.joiner);
+        }
+        return p.continuation ? p.continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() {
+      exception = std::current_exception();
+  }
+};
+
+template <typename T>
+struct co_task_promise : co_task_promise_base {
+  std::optional<T> value;
+
+  co_task<T> get_return_object();
+
+  template <typename V>
+  void return_value(V&& v) {
+      value.emplace(std::forward<V>(v));
+  }
+};
+
+template <>
+struct co_task_promise<void> : co_task_promise_base {
+  co_task<void> get_return_object();
+
+  void return_void() {}
+};
+
+template <typename T = void>
+class [[nodiscard]] co_task {
+public:
+  using promise_type = co_task_promise<T>;
+
+private:
+  std::coroutine_handle<promise_type> _handle;
+
+public:
+  explicit co_task(std::coroutine_handle<promise_type> h) : _handle(h) {}
+
+  co_task(co_task&& x) noexcept : _handle(std::exchange(x._handle, nullptr)) {}
+
+  co_task& operator=(co_task&& x) noexcept {
+      if (this != &x) {
+          this->~co_task();
+          new (this) co_task(std::move(x));
+      }
+      return *this;
+  }
+
+  // A coroutine that has started and not finished runs on detached, and
+  // its frame goes away when it returns.
+  ~co_task() {
+      if (!_handle) {
+          return;
+      }
+      auto& p = _handle.promise();
+      if (p.started && !p.done) {
+          p.detached = true;
+      } else {
+          _handle.destroy();
+      }
+  }
+
+  bool done() const { return _handle.promise().done; }
+
+  // Queues the coroutine to start from the scheduler's loop, without
+  // waiting for it.
+  void start() {
+      auto& p = _handle.promise();
+      assert(!p.started);
+      p.started = true;
+      p.link.handle = _handle;
+      scheduler::local().make_ready(p.link);
+  }
+
+  // Called from a fiber: starts the coroutine if need be, parks until it
+  // has returned and hands out its result. A cancellation point.
+  T join() {
+      auto& p = _handle.promise();
+      if (!p.started) {
+          p.started = true;
+          _handle.resume();
+      }
+      try {
+          while (!p.done) {
+              cancellation_point();
+              p.joiner = g_current_context;
+              scheduler::local().park();
+          }
+      } catch (...) {
+          p.joiner = nullptr;
+          throw;
+      }
+      p.joiner = nullptr;
+      return take();
+  }
+
+  struct awaiter {
+    co_task& task;
+
+    bool await_ready() const noexcept { return task.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+        auto& p = task._handle.promise();
+        p.continuation = c;
+        if (!p.started) {
+            p.started = true;
+            return task._handle;
+        }
+        return std::noop_coroutine();
+    }
+
+    T await_resume() { return task.take(); }
+  };
+
+  awaiter operator co_await() & noexcept { return awaiter{*this}; }
+  awaiter operator co_await() && noexcept { return awaiter{*this}; }
+
+private:
+  T take() {
+      auto& p = _handle.promise();
+      assert(p.done);
+      if (p.exception) {
+          std::rethrow_exception(std::exchange(p.exception, nullptr));
+      }
+      if constexpr (!std::is_void_v<T>) {
+          return std::move(*p.value);
+      }
+  }
+};
+
+template <typename T>
+co_task<T> co_task_promise<T>::get_return_object() {
+    return co_task<T>(std::coroutine_handle<co_task_promise<T>>::from_promise(*this));
+}
+
+inline co_task<void> co_task_promise<void>::get_return_object() {
+    return co_task<void>(std::coroutine_handle<co_task_promise<void>>::from_promise(*this));
+}
+
+// Coroutine frames come from plain operator new.
+static_assert(alignof(co_task_promise<void>) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+static_assert(alignof(co_task_promise<long double>) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+// co_await reschedule(): lets the fibers and coroutines that are ready run
+// first, like scheduler::yield() lets a fiber.
+inline auto reschedule() {
+    struct awaiter : coroutine_link {
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<> c) {
+          handle = c;
+          scheduler::local().make_ready(*this);
+      }
+
+      void await_resume() const noexcept {}
+    };
+    return awaiter{};
+}
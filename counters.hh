@@ -0,0 +1,355 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Scheduler counters.
+//
+// Every thread counts its context switches, how long fibers run between
+// switches, how deep its ready queue is when the scheduler picks a fiber,
+// its steal attempts and how long its reactor sleeps. The counts live in
+// g_counters, a thread_local next to g_current_context: only the owning
+// thread writes them, with plain relaxed stores, so counting touches no
+// cache line another core writes to. Durations are taken from the cycle
+// counter (rdtsc, cntvct_el0) and converted to nanoseconds when read. Reading
+// it costs more than the rest of a switch, so only one slice in
+// slice_sample_interval is timed; the switch counts are exact.
+//
+// stats_snapshot() adds up the counters of every thread that called init(),
+// including the threads that have exited since, while they go on counting:
+// each value is exact, the whole is not one atomic cut. local_stats() reads
+// the calling thread's own.
+//
+// Build with -DFIBER_NO_COUNTERS to compile the counters out: no per-thread
+// storage, no registry, and the snapshots read zero.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+inline uint64_t cycle_count() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#endif
+}
+
+struct tick_calibration {
+  std::chrono::steady_clock::time_point time;
+  uint64_t ticks;
+};
+
+// Both clocks at one instant: the cycle count is the midpoint of two reads
+// around steady_clock's, which keeps the error of a pair to a few ticks.
+inline tick_calibration read_tick_calibration() {
+    auto before = cycle_count();
+    auto time = std::chrono::steady_clock::now();
+    auto after = cycle_count();
+    return {time, before + (after - before) / 2};
+}
+
+// The reference point of ns_per_tick(), taken on the first call, which
+// thread registration and tracer::start() make. Cheap: it only reads both
+// clocks.
+inline const tick_calibration& start_tick_calibration() {
+    static const tick_calibration start = read_tick_calibration();
+    return start;
+}
+
+// Nanoseconds per cycle_count() tick, measured against steady_clock since
+// start_tick_calibration(). Never waits: it gets more precise the longer
+// the process runs, and is a rough estimate only in its first
+// milliseconds.
+inline double ns_per_tick() {
+    auto& start = start_tick_calibration();
+    auto now = read_tick_calibration();
+    auto ticks = now.ticks - start.ticks;
+    return ticks ? std::chrono::duration<double, std::nano>(now.time - start.time).count() / ticks : 0;
+}
+
+// Bucket 0 counts zeros, bucket b > 0 the values in [2^(b-1), 2^b).
+struct log2_histogram {
+  static constexpr size_t nr_buckets = 48;
+
+  std::array<uint64_t, nr_buckets> buckets = {};
+
+  static size_t bucket_of(uint64_t v) {
+      return std::min<size_t>(std::bit_width(v), nr_buckets - 1);
+  }
+
+  uint64_t count() const {
+      uint64_t n = 0;
+      for (auto b : buckets) {
+          n += b;
+      }
+      return n;
+  }
+
+  // The upper bound of the bucket the q-quantile falls in, q in [0, 1].
+  uint64_t quantile(double q) const {
+      auto rank = uint64_t(q * count());
+      uint64_t seen = 0;
+      for (size_t b = 0; b < nr_buckets; b++) {
+          seen += buckets[b];
+          if (seen > rank) {
+              return b ? (uint64_t(1) << b) - 1 : 0;
+          }
+      }
+      return 0;
+  }
+
+  void merge(const log2_histogram& x) {
+      for (size_t b = 0; b < nr_buckets; b++) {
+          buckets[b] += x.buckets[b];
+      }
+  }
+};
+
+struct fiber_stats {
+  uint64_t enters = 0;    // jmp_buf_link::enter()
+  uint64_t leaves = 0;    // jmp_buf_link::leave()
+  uint64_t hand_offs = 0; // jmp_buf_link::switch_to()
+  uint64_t ends = 0;      // jmp_buf_link::end()
+
+  // Over the sampled slices: how long a fiber ran from one switch to the
+  // next, in ticks.
+  uint64_t run_ticks = 0;
+  log2_histogram run_slice;
+
+  uint64_t ready_samples = 0; // fibers the scheduler popped
+  uint64_t ready_depth_total = 0;
+  uint64_t ready_depth_max = 0;
+
+  uint64_t steal_attempts = 0; // victims tried by work_stealing_scheduler
+  uint64_t steals = 0;         // fibers taken from a victim
+
+  uint64_t reactor_waits = 0;
+  uint64_t reactor_wait_ticks = 0;
+
+  double ns_per_tick = 0; // for the tick counts above
+
+  uint64_t switches() const { return enters + leaves + hand_offs + ends; }
+  double mean_run_slice_ns() const {
+      auto n = run_slice.count();
+      return n ? run_ticks * ns_per_tick / n : 0;
+  }
+  double run_slice_ns(double q) const { return run_slice.quantile(q) * ns_per_tick; }
+  double reactor_wait_ns() const { return reactor_wait_ticks * ns_per_tick; }
+  double mean_ready_depth() const {
+      return ready_samples ? double(ready_depth_total) / ready_samples : 0;
+  }
+
+  void merge(const fiber_stats& x) {
+      enters += x.enters;
+      leaves += x.leaves;
+      hand_offs += x.hand_offs;
+      ends += x.ends;
+      run_ticks += x.run_ticks;
+      run_slice.merge(x.run_slice);
+      ready_samples += x.ready_samples;
+      ready_depth_total += x.ready_depth_total;
+      ready_depth_max = std::max(ready_depth_max, x.ready_depth_max);
+      steal_attempts += x.steal_attempts;
+      steals += x.steals;
+      reactor_waits += x.reactor_waits;
+      reactor_wait_ticks += x.reactor_wait_ticks;
+  }
+};
+
+#ifndef FIBER_NO_COUNTERS
+// One thread's counts. Trivially destructible and constant-initialized, so
+// the thread_local needs no guard on access.
+class fiber_counters {
+public:
+  static constexpr unsigned slice_sample_interval = 16;
+
+private:
+  // Written by the owning thread only, read by any.
+  struct counter {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void raise(uint64_t n) {
+        if (n > value.load(std::memory_order_relaxed)) {
+            value.store(n, std::memory_order_relaxed);
+        }
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+  };
+
+  counter _enters, _leaves, _hand_offs, _ends;
+  counter _run_ticks;
+  std::array<counter, log2_histogram::nr_buckets> _run_slice;
+  counter _ready_samples, _ready_depth_total, _ready_depth_max;
+  counter _steal_attempts, _steals;
+  counter _reactor_waits, _reactor_wait_ticks;
+  uint64_t _slice_start = 0; // when the sampled slice began, if any
+  unsigned _until_sample = slice_sample_interval;
+  bool _sampling = false;
+
+public:
+  // Called before each switch; from_fiber unless switching off the thread's
+  // own context, whose time is not a fiber's.
+  void on_enter(bool from_fiber) { _enters.add(1); switched(from_fiber); }
+  void on_leave() { _leaves.add(1); switched(true); }
+  void on_hand_off() { _hand_offs.add(1); switched(true); }
+  void on_end() { _ends.add(1); switched(true); }
+
+  void on_ready_pop(size_t depth) {
+      _ready_samples.add(1);
+      _ready_depth_total.add(depth);
+      _ready_depth_max.raise(depth);
+  }
+
+  void on_steal(bool success) {
+      _steal_attempts.add(1);
+      _steals.add(success);
+  }
+
+  uint64_t start_reactor_wait() const { return cycle_count(); }
+  void on_reactor_wait(uint64_t start) {
+      _reactor_waits.add(1);
+      _reactor_wait_ticks.add(cycle_count() - start);
+  }
+
+  // Callable from any thread; ns_per_tick is left to the caller.
+  fiber_stats read() const {
+      fiber_stats s;
+      s.enters = _enters.get();
+      s.leaves = _leaves.get();
+      s.hand_offs = _hand_offs.get();
+      s.ends = _ends.get();
+      s.run_ticks = _run_ticks.get();
+      for (size_t b = 0; b < log2_histogram::nr_buckets; b++) {
+          s.run_slice.buckets[b] = _run_slice[b].get();
+      }
+      s.ready_samples = _ready_samples.get();
+      s.ready_depth_total = _ready_depth_total.get();
+      s.ready_depth_max = _ready_depth_max.get();
+      s.steal_attempts = _steal_attempts.get();
+      s.steals = _steals.get();
+      s.reactor_waits = _reactor_waits.get();
+      s.reactor_wait_ticks = _reactor_wait_ticks.get();
+      return s;
+  }
+
+private:
+  void switched(bool from_fiber) {
+      if (_sampling) [[unlikely]] {
+          _sampling = false;
+          if (from_fiber) {
+              auto slice = cycle_count() - _slice_start;
+              _run_ticks.add(slice);
+              _run_slice[log2_histogram::bucket_of(slice)].add(1);
+          }
+      }
+      if (--_until_sample == 0) [[unlikely]] {
+          _until_sample = slice_sample_interval;
+          _sampling = true;
+          _slice_start = cycle_count();
+      }
+  }
+};
+
+inline thread_local fiber_counters g_counters;
+#else
+// Counts nothing and has no state, so g_counters takes no storage.
+class fiber_counters {
+public:
+  void on_enter(bool) const {}
+  void on_leave() const {}
+  void on_hand_off() const {}
+  void on_end() const {}
+  void on_ready_pop(size_t) const {}
+  void on_steal(bool) const {}
+  uint64_t start_reactor_wait() const { return 0; }
+  void on_reactor_wait(uint64_t) const {}
+
+  fiber_stats read() const { return {}; }
+};
+
+inline constexpr fiber_counters g_counters;
+#endif
+
+#ifndef FIBER_NO_COUNTERS
+// The counters of the threads that called init().
+class counters_registry {
+  std::mutex _mutex;
+  std::vector<const fiber_counters*> _threads;
+  fiber_stats _exited;
+
+public:
+  static counters_registry& instance() {
+      static counters_registry registry;
+      return registry;
+  }
+
+  // Called by every thread that runs fibers; later calls are no-ops.
+  void add_this_thread() {
+      struct registration {
+        registration() {
+            start_tick_calibration();
+            auto& r = instance();
+            std::lock_guard<std::mutex> lock(r._mutex);
+            r._threads.push_back(&g_counters);
+        }
+
+        ~registration() {
+            auto& r = instance();
+            std::lock_guard<std::mutex> lock(r._mutex);
+            r._exited.merge(g_counters.read());
+            r._threads.erase(std::remove(r._threads.begin(), r._threads.end(), &g_counters), r._threads.end());
+        }
+      };
+      static thread_local registration reg;
+  }
+
+  fiber_stats snapshot() {
+      fiber_stats s;
+      {
+          std::lock_guard<std::mutex> lock(_mutex);
+          s = _exited;
+          for (auto c : _threads) {
+              s.merge(c->read());
+          }
+      }
+      s.ns_per_tick = ns_per_tick();
+      return s;
+  }
+};
+#else
+class counters_registry {
+public:
+  static counters_registry& instance() {
+      static counters_registry registry;
+      return registry;
+  }
+
+  void add_this_thread() {}
+  fiber_stats snapshot() { return {}; }
+};
+#endif
+
+inline fiber_stats stats_snapshot() {
+    return counters_registry::instance().snapshot();
+}
+
+inline fiber_stats local_stats() {
+    auto s = g_counters.read();
+    s.ns_per_tick = ns_per_tick();
+    return s;
+}
@@ -0,0 +1,551 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Typed fiber entry points.
+//
+//   auto h = spawn([] (int lo, int hi) { return sum(lo, hi); }, 0, 100);
+//   ...
+//   auto total = h.join();
+//
+// spawn() takes a stack from the pool and builds the fiber's context and a
+// copy of the callable and its arguments (decayed, moved in when passed as
+// rvalues) at the top of it, so starting a fiber allocates nothing beyond
+// the stack. A stack_size that leaves less than min_usable_stack below them
+// is rejected with std::invalid_argument. The fiber is made ready on the
+// scheduler of the calling thread without being switched to: its first
+// switch is when the scheduler picks it, and a fiber cancelled before that
+// is discarded without ever running.
+// When it returns, the callable and arguments are destroyed on its stack,
+// and the stack goes back to the pool as soon as the fiber has switched off
+// it for the last time.
+//
+// The result, or the exception that escaped the fiber, is moved into the
+// join_handle when the fiber returns, and join() hands it out. The
+// handle and the fiber point at each other and a moved handle re-points
+// the fiber at itself, so the result needs no shared state either. A fiber
+// whose handle is dropped runs on detached and its result is discarded.
+// The one exception is a handle on a shared stack (see copy_stack below),
+// whose frames move: it keeps what the fiber writes in a cell on the heap.
+//
+// A C++20 coroutine waits for a fiber with co_await on its handle instead of
+// join(), see coroutine.hh.
+//
+// A fiber spawned with fiber_config::copy_stack has no stack of its own: it
+// runs on the given shared stack (e.g. run_stack::local()) and its frames
+// are copied off it while other fibers use it, see context.hh. Its context
+// and callable are then allocated together on the heap. Such fibers cannot
+// run on a work_stealing_scheduler. Copying frames takes asm_context: built
+// with -DFIBER_CONTEXT_SETJMP, spawn() rejects copy_stack with
+// std::invalid_argument. While such a fiber is switched out, nothing may
+// point into its frames: the library's own waits and join handles take
+// care of that, but a pointer the fiber hands out to a local of its own
+// (say, for another fiber to write a reply into) dangles.
+//
+// spawn_bulk(n, func) spawns n fibers running func(0) ... func(n - 1) with
+// one trip to the stack pool and one splice into the ready queue. Given a
+// vector, it appends their handles to it instead of returning a new one.
+//
+// A fiber spawned with fiber_config::arena_size allocates through
+// fiber_memory_resource() from an arena freed as it is reclaimed, see
+// arena.hh.
+//
+// With the stack_profiler enabled, spawn() paints the stack and the fiber's
+// stack use is recorded under fiber_config::name, or the demangled type of
+// the callable when it has none, as it is reclaimed.
+
+#pragma once
+
+#include "arena.hh"
+#include "context.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+struct fiber_config {
+  size_t stack_size = 64 * 1024;
+  // Of the spawn site, in stack profiles and traces. Read until the fiber
+  // has ended; traces keep a copy.
+  const char* name = nullptr;
+  shared_stack* copy_stack = nullptr; // run on it instead of on stack_size bytes of its own
+  size_t arena_size = 0; // slab size of its fiber_arena, 0 for none
+  fiber_class priority = fiber_class::latency;
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+template <typename T>
+class join_handle;
+
+template <typename T>
+struct fiber_promise;
+
+// What a join_handle and its fiber share.
+template <typename T>
+struct join_state {
+  using stored_type = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+  fiber_promise<T>* promise = nullptr; // until the fiber has returned
+  std::optional<stored_type> result;
+  std::exception_ptr exception;
+  jmp_buf_link* joiner = nullptr;
+  coroutine_link* co_joiner = nullptr; // a coroutine awaiting it
+
+  join_state() = default;
+
+  join_state(join_state&& x) noexcept
+      : promise(std::exchange(x.promise, nullptr))
+      , result(std::move(x.result))
+      , exception(std::move(x.exception))
+      , joiner(std::exchange(x.joiner, nullptr))
+      , co_joiner(std::exchange(x.co_joiner, nullptr)) {}
+};
+
+// The fiber's end of a join_handle.
+template <typename T>
+struct fiber_promise {
+  join_state<T>* handle = nullptr;
+  jmp_buf_link* fiber = nullptr;
+
+  template <typename... V>
+  void set_value(V&&... v);
+  void set_exception(std::exception_ptr ex);
+
+private:
+  join_state<T>* complete();
+};
+
+template <typename T>
+class join_handle {
+  // In the handle, unless the handle is on a shared stack: its state is
+  // written while the frames may be copied off it, so it goes to the heap.
+  join_state<T> _state;
+  std::unique_ptr<join_state<T>> _pinned;
+
+public:
+  join_handle() = default;
+
+  // Terminates if the handle is on a shared stack and there is no memory
+  // left for its state, as does a move onto one.
+  explicit join_handle(fiber_promise<T>& p) noexcept {
+      _state.promise = &p;
+      attach();
+  }
+
+  // State that is on the heap moves as it is.
+  join_handle(join_handle&& x) noexcept
+      : _state(std::move(x._state))
+      , _pinned(std::move(x._pinned)) {
+      if (_state.promise) {
+          attach();
+      }
+  }
+
+  join_handle& operator=(join_handle&& x) noexcept {
+      if (this != &x) {
+          this->~join_handle();
+          new (this) join_handle(std::move(x));
+      }
+      return *this;
+  }
+
+  ~join_handle() {
+      detach();
+  }
+
+  bool valid() const { return state().promise || done(); }
+  bool done() const { return state().result || state().exception; }
+
+  // Lets the fiber run on without anyone waiting for its result.
+  void detach() {
+      auto& s = state();
+      if (s.promise) {
+          s.promise->handle = nullptr;
+          s.promise = nullptr;
+      }
+  }
+
+  // Unwinds the fiber from its next cancellation point, see
+  // scheduler::cancel(); join() then throws fiber_cancelled, unless the
+  // fiber catches it or has returned already. Called on the fiber's thread:
+  // it goes through that thread's scheduler.
+  void cancel() {
+      if (auto p = state().promise) {
+          scheduler::local().cancel(*p->fiber);
+      }
+  }
+
+  // Called from a fiber: parks until the fiber has returned, then hands
+  // out its result or rethrows what escaped it. Outside of a fiber, only
+  // once done(). A cancellation point.
+  T join() {
+      assert(valid());
+      auto& s = state();
+      try {
+          while (!done()) {
+              cancellation_point();
+              s.joiner = g_current_context;
+              scheduler::local().park();
+          }
+      } catch (...) {
+          s.joiner = nullptr;
+          throw;
+      }
+      s.joiner = nullptr;
+      return take();
+  }
+
+  struct awaiter : coroutine_link {
+    join_handle& h;
+
+    explicit awaiter(join_handle& x) : h(x) {}
+
+    bool await_ready() const noexcept { return h.done(); }
+
+    void await_suspend(std::coroutine_handle<> c) noexcept {
+        handle = c;
+        h.state().co_joiner = this;
+    }
+
+    T await_resume() {
+        h.state().co_joiner = nullptr;
+        return h.take();
+    }
+  };
+
+  // From a coroutine: suspends it, rather than the thread's fiber, until the
+  // fiber has returned, like join() does.
+  awaiter operator co_await() & noexcept { assert(valid()); return awaiter(*this); }
+  awaiter operator co_await() && noexcept { assert(valid()); return awaiter(*this); }
+
+private:
+  join_state<T>& state() { return _pinned ? *_pinned : _state; }
+  const join_state<T>& state() const { return _pinned ? *_pinned : _state; }
+
+  // Points the fiber at the state in the handle, or on the heap if the
+  // handle is on the shared stack of the current fiber.
+  void attach() noexcept {
+      auto c = g_current_context;
+      if (c && c->shared) [[unlikely]] {
+          attach_from(*c->shared);
+          return;
+      }
+      _state.promise->handle = &_state;
+  }
+
+  [[gnu::noinline]] void attach_from(const shared_stack& stack) noexcept {
+      auto p = reinterpret_cast<const char*>(this);
+      if (p >= stack.bottom && p < stack.bottom + stack.size) {
+          _pinned = std::make_unique<join_state<T>>(std::move(_state));
+          _pinned->promise->handle = _pinned.get();
+      } else {
+          _state.promise->handle = &_state;
+      }
+  }
+
+  T take() {
+      auto& s = state();
+      if (s.exception) {
+          std::rethrow_exception(std::exchange(s.exception, nullptr));
+      }
+      if constexpr (!std::is_void_v<T>) {
+          auto v = std::move(*s.result);
+          s.result.reset();
+          return v;
+      } else {
+          s.result.reset();
+      }
+  }
+};
+
+// Detaches the handle, if any, and wakes whoever joins it.
+template <typename T>
+join_state<T>* fiber_promise<T>::complete() {
+    auto h = std::exchange(handle, nullptr);
+    if (h) {
+        h->promise = nullptr;
+        if (h->joiner) {
+            scheduler::local().wake(*h->joiner);
+        } else if (h->co_joiner) {
+            scheduler::local().make_ready(*h->co_joiner);
+        }
+    }
+    return h;
+}
+
+template <typename T>
+template <typename... V>
+void fiber_promise<T>::set_value(V&&... v) {
+    if (handle) {
+        handle->result.emplace(std::forward<V>(v)...);
+        complete();
+    }
+}
+
+template <typename T>
+void fiber_promise<T>::set_exception(std::exception_ptr ex) {
+    if (handle) {
+        handle->exception = std::move(ex);
+        complete();
+    }
+}
+
+// The context of a spawned fiber, at the very top of its stack. It owns the
+// stack, which goes back to the pool when the context is reclaimed, right
+// after the fiber's last switch off it. The fields it adds are cold: they sit
+// below the cache line of the jmp_buf_link it starts with.
+struct fiber_frame : jmp_buf_link {
+  stack_ptr stack;
+  const char* profile_entry = nullptr; // when the stack_profiler watches it
+  size_t profile_size = 0;            // painted bytes from the stack bottom
+
+  fiber_frame() {
+      reclaim = [] (jmp_buf_link* f) {
+          auto self = static_cast<fiber_frame*>(f);
+          if (self->arena) {
+              fiber_arena::destroy(self->arena);
+          }
+          auto stack = std::move(self->stack);
+          if (self->profile_entry) {
+              auto used = stack_profiler::measure(stack.get(), self->profile_size);
+              stack_profiler::instance().record(self->profile_entry, stack.get_deleter().size, used);
+          }
+          self->~fiber_frame();
+      };
+  }
+};
+
+// The context of a fiber spawned onto a copy_stack, at the start of one heap
+// block with its fiber_task.
+struct copying_fiber_frame : jmp_buf_link {
+  copying_fiber_frame() {
+      reclaim = [] (jmp_buf_link* f) {
+          auto self = static_cast<copying_fiber_frame*>(f);
+          if (self->arena) {
+              fiber_arena::destroy(self->arena);
+          }
+          self->release_shared();
+          self->~copying_fiber_frame();
+          ::operator delete(self, std::align_val_t(alignof(copying_fiber_frame)));
+      };
+  }
+};
+
+// A shared_stack on a stack from the pool.
+class run_stack : public shared_stack {
+  stack_ptr _memory;
+
+public:
+  explicit run_stack(size_t stack_size = 256 * 1024) : _memory(make_stack(stack_size)) {
+      bottom = _memory.get();
+      size = stack_size;
+  }
+
+  run_stack(const run_stack&) = delete;
+  run_stack& operator=(const run_stack&) = delete;
+
+  static run_stack& local() {
+      static thread_local run_stack stack;
+      return stack;
+  }
+};
+
+// The name a callable's fibers are profiled and traced under by default.
+template <typename Func>
+const char* entry_name() {
+    static const std::string name = [] {
+        int status;
+        auto demangled = abi::__cxa_demangle(typeid(Func).name(), nullptr, nullptr, &status);
+        std::string s = status == 0 ? demangled : typeid(Func).name();
+        std::free(demangled);
+        return s;
+    }();
+    return name.c_str();
+}
+
+// What spawn() puts on the stack right below the fiber_frame.
+template <typename Func, typename... Args>
+struct fiber_task {
+  using result_type = std::invoke_result_t<Func, Args...>;
+
+  fiber_promise<result_type> promise;
+  Func func;
+  std::tuple<Args...> args;
+
+  template <typename F, typename... A>
+  fiber_task(F&& f, A&&... a) : func(std::forward<F>(f)), args(std::forward<A>(a)...) {}
+
+  static void run(void* arg) {
+      MAKE_FRAME();
+      auto self = static_cast<fiber_task*>(arg);
+      g_current_context->discard = nullptr;
+      // Nothing may escape: the frame above has no unwind information.
+      try {
+          if constexpr (std::is_void_v<result_type>) {
+              std::apply(std::move(self->func), std::move(self->args));
+              self->promise.set_value(true);
+          } else {
+              self->promise.set_value(std::apply(std::move(self->func), std::move(self->args)));
+          }
+      } catch (...) {
+          self->promise.set_exception(std::current_exception());
+      }
+      self->~fiber_task();
+  }
+
+  // Instead of run(), for a fiber cancelled before it started.
+  static void discard(void* arg) {
+      auto self = static_cast<fiber_task*>(arg);
+      self->promise.set_exception(std::make_exception_ptr(fiber_cancelled()));
+      self->~fiber_task();
+  }
+};
+
+// What spawn() leaves at least of a stack for the fiber to run on, once the
+// fiber_frame and the callable are carved off its top.
+constexpr size_t min_usable_stack = 2048;
+
+// Builds a fiber of spawn() and adds it to batch without starting it. It
+// runs on stack, or on config.copy_stack when that is set. The caller makes
+// the join_handle from the returned promise, in place.
+template <typename Func, typename... Args>
+auto prepare_fiber(scheduler::ready_queue& batch, const fiber_config& config, stack_ptr&& stack,
+                   Func&& func, Args&&... args)
+        -> fiber_promise<std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>>& {
+    using task = fiber_task<std::decay_t<Func>, std::decay_t<Args>...>;
+#ifdef FIBER_CONTEXT_SETJMP
+    if (config.copy_stack) {
+        assert(!"fiber_config::copy_stack needs asm_context");
+        throw std::invalid_argument("fiber_config::copy_stack is not supported with FIBER_CONTEXT_SETJMP");
+    }
+#endif
+    if (!config.copy_stack) {
+        constexpr auto reserved = sizeof(fiber_frame) + alignof(fiber_frame) + sizeof(task) + alignof(task);
+        if (config.stack_size < reserved + min_usable_stack) {
+            throw std::invalid_argument("fiber_config::stack_size too small for the fiber's context and callable");
+        }
+    }
+    std::unique_ptr<fiber_arena, fiber_arena::deleter> arena;
+    if (config.arena_size) {
+        arena = fiber_arena::create(config.arena_size);
+    }
+    if (auto shared = config.copy_stack) {
+        constexpr auto align = std::align_val_t(alignof(copying_fiber_frame));
+        constexpr auto task_at = (sizeof(copying_fiber_frame) + alignof(task) - 1) & ~(alignof(task) - 1);
+        static_assert(alignof(task) <= alignof(copying_fiber_frame));
+        auto block = static_cast<char*>(::operator new(task_at + sizeof(task), align));
+        task* t;
+        try {
+            t = new (block + task_at) task(std::forward<Func>(func), std::forward<Args>(args)...);
+        } catch (...) {
+            ::operator delete(block, align);
+            throw;
+        }
+        auto context = new (block) copying_fiber_frame();
+        context->shared = shared;
+        context->priority = config.priority;
+        context->deadline = config.deadline;
+        context->arena = arena.release();
+#ifdef FIBER_TRACE
+        context->trace_name = config.name ? tracer::intern(config.name) : entry_name<std::decay_t<Func>>();
+#endif
+        t->promise.fiber = context;
+        context->discard = &task::discard;
+        context->discard_arg = t;
+        scheduler::prepare(batch, context, shared->bottom, shared->size, &task::run, t);
+        return t->promise;
+    }
+    auto bottom = stack.get();
+    auto top = reinterpret_cast<uintptr_t>(bottom) + config.stack_size;
+    auto frame_at = (top - sizeof(fiber_frame)) & ~(alignof(fiber_frame) - 1);
+    auto task_at = (frame_at - sizeof(task)) & ~(alignof(task) - 1);
+    auto t = new (reinterpret_cast<void*>(task_at)) task(std::forward<Func>(func), std::forward<Args>(args)...);
+    auto context = new (reinterpret_cast<void*>(frame_at)) fiber_frame();
+    context->stack = std::move(stack);
+    context->priority = config.priority;
+    context->deadline = config.deadline;
+    context->arena = arena.release();
+#ifdef FIBER_TRACE
+    context->trace_name = config.name ? tracer::intern(config.name) : entry_name<std::decay_t<Func>>();
+#endif
+    t->promise.fiber = context;
+    auto usable = reinterpret_cast<char*>(t) - bottom;
+    if (auto& profiler = stack_profiler::instance(); profiler.enabled()) [[unlikely]] {
+        stack_profiler::paint(bottom, usable);
+        context->profile_entry = config.name ? config.name : entry_name<std::decay_t<Func>>();
+        context->profile_size = usable;
+    }
+    context->discard = &task::discard;
+    context->discard_arg = t;
+    scheduler::prepare(batch, context, bottom, usable, &task::run, t);
+    return t->promise;
+}
+
+template <typename Func, typename... Args>
+auto spawn(const fiber_config& config, Func&& func, Args&&... args)
+        -> join_handle<std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>> {
+    scheduler::ready_queue batch;
+    join_handle<std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>> handle(
+            prepare_fiber(batch, config, config.copy_stack ? stack_ptr() : make_stack(config.stack_size),
+                          std::forward<Func>(func), std::forward<Args>(args)...));
+    scheduler::local().make_ready(batch);
+    return handle;
+}
+
+template <typename Func, typename... Args>
+    requires (!std::is_same_v<std::decay_t<Func>, fiber_config>)
+auto spawn(Func&& func, Args&&... args) {
+    return spawn(fiber_config{}, std::forward<Func>(func), std::forward<Args>(args)...);
+}
+
+// Spawns n fibers running copies of func, fiber i calling func(i), for a
+// fan-out, and appends their handles to handles: the stacks are taken from
+// the pool in one go and the fibers queued with one splice once all are
+// built. A fan-out that repeats reuses the vector's capacity. If building
+// one throws, the ones built already start anyway, detached, and handles
+// is left as it was.
+template <typename Func>
+void spawn_bulk(const fiber_config& config, size_t n, Func&& func,
+                std::vector<join_handle<std::invoke_result_t<std::decay_t<Func>, size_t>>>& handles) {
+    auto first = handles.size();
+    handles.reserve(first + n);
+    auto stacks = make_stacks(config.stack_size, config.copy_stack ? 0 : n);
+    scheduler::ready_queue batch;
+    try {
+        for (size_t i = 0; i < n; i++) {
+            handles.emplace_back(prepare_fiber(batch, config, config.copy_stack ? stack_ptr() : stacks.take(), func, i));
+        }
+    } catch (...) {
+        handles.erase(handles.begin() + first, handles.end());
+        scheduler::local().make_ready(batch);
+        throw;
+    }
+    scheduler::local().make_ready(batch);
+}
+
+template <typename Func>
+auto spawn_bulk(const fiber_config& config, size_t n, Func&& func)
+        -> std::vector<join_handle<std::invoke_result_t<std::decay_t<Func>, size_t>>> {
+    std::vector<join_handle<std::invoke_result_t<std::decay_t<Func>, size_t>>> handles;
+    spawn_bulk(config, n, std::forward<Func>(func), handles);
+    return handles;
+}
+
+template <typename Func>
+auto spawn_bulk(size_t n, Func&& func) {
+    return spawn_bulk(fiber_config{}, n, std::forward<Func>(func));
+}
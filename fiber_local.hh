@@ -0,0 +1,87 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Fiber-local storage.
+//
+//   inline fiber_local<uint64_t> g_trace_id;
+//   ...
+//   *g_trace_id = request.trace_id; // in the fiber handling the request
+//
+// thread_local is per thread, and a thread runs many fibers, of one
+// request each, or a fiber moves between the threads of a
+// work_stealing_scheduler. A fiber_local<T> holds one T per context
+// instead. Every fiber_local takes a slot index when it is constructed, and
+// every context has an array of max_fiber_locals value pointers, found
+// through current_context(): get() is a call, a few dependent loads and a
+// test. A context's first access to any fiber_local allocates its array,
+// the first to each one a copy of the initial value; after that nothing
+// allocates. The values are destroyed when the fiber's entry function
+// returns, on its stack.
+//
+// The call is not inlined on purpose: the compiler may keep the address of
+// a thread_local, g_current_context among them, across a switch, after
+// which a fiber of a work_stealing_scheduler may run on another thread. A
+// reference that get() returned stays valid across switches, as it is the
+// fiber's own; one into a plain thread_local does not, and nothing here
+// guards against that.
+//
+// Slots are never reused, so fiber_locals are meant to be globals. A
+// thread's own context has values too, which are not destroyed, and
+// coroutines share the values of the context resuming them.
+
+#pragma once
+
+#include "context.hh"
+
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+template <typename T>
+class fiber_local {
+  size_t _index;
+  T _initial;
+
+public:
+  // Every context starts from a copy of T(a...).
+  template <typename... A>
+  explicit fiber_local(A&&... a) : _index(register_slot()), _initial(std::forward<A>(a)...) {}
+
+  fiber_local(const fiber_local&) = delete;
+  fiber_local& operator=(const fiber_local&) = delete;
+
+  // The running context's value.
+  T& get() {
+      auto slots = current_context()->locals;
+      if (slots && slots[_index]) [[likely]] {
+          return *static_cast<T*>(slots[_index]);
+      }
+      return create();
+  }
+
+  T& operator*() { return get(); }
+  T* operator->() { return &get(); }
+
+private:
+  static size_t register_slot() {
+      auto index = g_nr_fiber_locals.fetch_add(1, std::memory_order_relaxed);
+      if (index >= max_fiber_locals) {
+          throw std::length_error("too many fiber_locals");
+      }
+      g_fiber_local_destructors[index] = [] (void* v) { delete static_cast<T*>(v); };
+      return index;
+  }
+
+  [[gnu::noinline]] T& create() {
+      auto self = current_context();
+      if (!self->locals) {
+          self->locals = static_cast<void**>(std::calloc(max_fiber_locals, sizeof(void*)));
+          if (!self->locals) {
+              throw std::bad_alloc();
+          }
+      }
+      auto v = new T(_initial);
+      self->locals[_index] = v;
+      return *v;
+  }
+};
@@ -0,0 +1,241 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Non-blocking logging for fibers.
+//
+// log_line() formats a line with fmt straight into a lock-free ring owned
+// by the calling thread and returns. A background drainer thread collects
+// the lines of every thread's ring at a fixed interval, or early when a
+// ring is half full, and writes them out in batches. Logging takes no lock;
+// only asking for an early drain, once a ring per drain, may make a futex
+// call to wake the drainer. When a ring is full the line is dropped and
+// counted rather than waiting for the drainer, and lines longer than a slot
+// are truncated.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fmt/core.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Single producer (the owning thread), single consumer (the drainer).
+class log_ring {
+public:
+  static constexpr size_t slot_size = 256;
+  static constexpr size_t capacity = 4096;
+
+  struct slot {
+    uint32_t len;
+    char text[slot_size - sizeof(uint32_t)];
+  };
+
+private:
+  alignas(64) std::atomic<size_t> _head{0}; // owned by the consumer
+  alignas(64) std::atomic<size_t> _tail{0}; // owned by the producer
+  size_t _cached_head = 0;
+  std::atomic<bool> _drain_requested{false}; // cleared by drain()
+  std::atomic<uint64_t> _dropped{0};
+  std::unique_ptr<slot[]> _slots{new slot[capacity]};
+
+public:
+  std::atomic<bool> orphaned{false}; // the owning thread is gone
+
+  // Producer: a free slot, or nullptr when the ring is full.
+  slot* reserve() {
+      auto tail = _tail.load(std::memory_order_relaxed);
+      if (tail - _cached_head == capacity) {
+          _cached_head = _head.load(std::memory_order_acquire);
+          if (tail - _cached_head == capacity) {
+              _dropped.fetch_add(1, std::memory_order_relaxed);
+              return nullptr;
+          }
+      }
+      return &_slots[tail % capacity];
+  }
+
+  // Producer: publishes the slot returned by reserve(). Returns whether the
+  // ring is now more than half full and the producer should ask for a
+  // drain.
+  bool commit() {
+      auto tail = _tail.load(std::memory_order_relaxed) + 1;
+      _tail.store(tail, std::memory_order_release);
+      if (tail - _cached_head <= capacity / 2) {
+          return false;
+      }
+      _cached_head = _head.load(std::memory_order_acquire);
+      return tail - _cached_head > capacity / 2 && want_drain();
+  }
+
+  // Producer: whether no drain has been asked for since the last one.
+  bool want_drain() {
+      return !_drain_requested.exchange(true, std::memory_order_relaxed);
+  }
+
+  // Consumer: appends every published line to out.
+  void drain(std::string& out) {
+      auto head = _head.load(std::memory_order_relaxed);
+      auto tail = _tail.load(std::memory_order_acquire);
+      for (; head != tail; head++) {
+          auto& s = _slots[head % capacity];
+          out.append(s.text, s.len);
+          out.push_back('\n');
+      }
+      _head.store(head, std::memory_order_release);
+      _drain_requested.store(false, std::memory_order_relaxed);
+  }
+
+  uint64_t take_dropped() {
+      return _dropped.exchange(0, std::memory_order_relaxed);
+  }
+};
+
+// _mutex guards the rings and the drainer's waits and is never held across
+// a write; _write_mutex, taken first, keeps the batches of concurrent
+// drains in order.
+class log_drainer {
+  std::mutex _mutex;
+  std::mutex _write_mutex;
+  std::condition_variable _cv;
+  std::vector<std::shared_ptr<log_ring>> _rings;
+  std::atomic<bool> _wanted{false}; // an early drain
+  bool _stopping = false;
+  int _fd = STDOUT_FILENO; // under _write_mutex
+  std::chrono::milliseconds _interval{10};
+  std::thread _thread;
+
+public:
+  log_drainer() : _thread([this] { run(); }) {}
+
+  ~log_drainer() {
+      {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _stopping = true;
+      }
+      _cv.notify_one();
+      _thread.join();
+  }
+
+  static log_drainer& instance() {
+      static log_drainer drainer;
+      return drainer;
+  }
+
+  // The ring of the calling thread.
+  static log_ring& local() {
+      struct holder {
+        std::shared_ptr<log_ring> ring = instance().add_ring();
+        ~holder() { ring->orphaned.store(true, std::memory_order_release); }
+      };
+      static thread_local holder h;
+      return *h.ring;
+  }
+
+  void set_output(int fd) {
+      std::lock_guard<std::mutex> lock(_write_mutex);
+      _fd = fd;
+  }
+
+  void set_interval(std::chrono::milliseconds interval) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _interval = interval;
+  }
+
+  // Asks for an early drain without taking a lock. A drainer that has just
+  // found the flag clear and is about to wait misses the notification, and
+  // drains at the end of its interval, as it would have without one.
+  void request_drain() {
+      _wanted.store(true, std::memory_order_relaxed);
+      _cv.notify_one();
+  }
+
+  // Drains every ring now, from the calling thread.
+  void flush() {
+      std::lock_guard<std::mutex> write_lock(_write_mutex);
+      std::string out;
+      {
+          std::lock_guard<std::mutex> lock(_mutex);
+          collect(out);
+      }
+      write(out);
+  }
+
+private:
+  std::shared_ptr<log_ring> add_ring() {
+      auto ring = std::make_shared<log_ring>();
+      std::lock_guard<std::mutex> lock(_mutex);
+      _rings.push_back(ring);
+      return ring;
+  }
+
+  // Appends the lines of every ring to out, under _mutex.
+  void collect(std::string& out) {
+      uint64_t dropped = 0;
+      for (auto it = _rings.begin(); it != _rings.end(); ) {
+          auto& ring = **it;
+          // Check before draining: a line published before the owner went
+          // away must not be left behind.
+          auto orphaned = ring.orphaned.load(std::memory_order_acquire);
+          ring.drain(out);
+          dropped += ring.take_dropped();
+          it = orphaned ? _rings.erase(it) : it + 1;
+      }
+      if (dropped) {
+          out += fmt::format("[log: {} lines dropped]\n", dropped);
+      }
+  }
+
+  // Under _write_mutex.
+  void write(const std::string& out) {
+      for (size_t done = 0; done < out.size(); ) {
+          auto r = ::write(_fd, out.data() + done, out.size() - done);
+          if (r <= 0) {
+              break;
+          }
+          done += r;
+      }
+  }
+
+  void run() {
+      bool stopping = false;
+      while (!stopping) {
+          {
+              std::unique_lock<std::mutex> lock(_mutex);
+              _cv.wait_for(lock, _interval, [this] {
+                  return _stopping || _wanted.load(std::memory_order_relaxed);
+              });
+              stopping = _stopping;
+          }
+          // Cleared first: a drain asked for while this one collects comes
+          // right after it.
+          _wanted.store(false, std::memory_order_relaxed);
+          flush();
+      }
+  }
+};
+
+// Logs one line; the newline is added by the drainer.
+template <typename... Args>
+void log_line(fmt::format_string<Args...> format, Args&&... args) {
+    auto& ring = log_drainer::local();
+    auto s = ring.reserve();
+    if (!s) {
+        if (ring.want_drain()) {
+            log_drainer::instance().request_drain();
+        }
+        return;
+    }
+    auto r = fmt::format_to_n(s->text, sizeof(s->text), format, std::forward<Args>(args)...);
+    s->len = std::min(r.size, sizeof(s->text));
+    if (ring.commit()) {
+        log_drainer::instance().request_drain();
+    }
+}
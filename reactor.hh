@@ -0,0 +1,594 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// I/O reactor for fibers.
+//
+// Every thread that runs a scheduler from scheduler.hh can own a reactor.
+// A fiber calling read(), write(), accept() or connect() queues the
+// operation and parks; the reactor, polled by the scheduler between fiber
+// runs, wakes it once the operation completes. Submissions are batched:
+// they are only flushed to the kernel when the ready queue has run dry or
+// a batch has filled up, so a round of fibers starting I/O costs one
+// system call.
+//
+// The io_uring backend is used when the kernel allows it, the epoll backend
+// otherwise or when built with -DFIBER_REACTOR_EPOLL. The epoll backend
+// retries operations when their descriptor becomes ready and so needs
+// non-blocking descriptors. With either backend a descriptor may have any
+// number of operations pending in each direction. The epoll backend
+// completes them first come, first served. accept() hands out
+// non-blocking sockets with either backend.
+//
+// Errors are thrown as std::system_error.
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+#include "timer.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <memory>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+
+struct io_request {
+  enum class op : uint8_t {
+    read,
+    write,
+    accept,
+    connect,
+  };
+
+  op kind;
+  int fd;
+  void* buf = nullptr;
+  size_t len = 0;
+  sockaddr* addr = nullptr;
+  socklen_t addrlen = 0;
+  bool started = false; // the epoll backend has issued connect()
+  bool done = false;
+  int result = 0; // as returned by the system call, -errno on failure
+  jmp_buf_link* waiter = nullptr;
+  io_request* next = nullptr; // in the epoll backend's queue of its fd
+};
+
+class reactor_backend {
+public:
+  virtual ~reactor_backend() = default;
+  virtual const char* name() const = 0;
+  // Queues the request; complete() is called when it is done, possibly
+  // before submit() returns.
+  virtual void submit(io_request& req) = 0;
+  // Hands queued requests to the kernel.
+  virtual void flush() = 0;
+  // Completes what is done. Waits up to timeout_ns (-1: no limit) for the
+  // first completion or wake(), unless timeout_ns is 0.
+  virtual void reap(int64_t timeout_ns) = 0;
+  // Whether reap(0) may find something without a system call.
+  virtual bool maybe_ready() const = 0;
+  virtual size_t unflushed() const = 0;
+  // Interrupts a reap() waiting on another thread.
+  virtual void wake() = 0;
+
+protected:
+  size_t _inflight = 0;
+
+  void complete(io_request& req, int result) {
+      req.result = result;
+      req.done = true;
+      _inflight--;
+      if (req.waiter) {
+          scheduler::local().wake(*req.waiter);
+      }
+  }
+
+public:
+  size_t inflight() const { return _inflight; }
+};
+
+class io_uring_backend final : public reactor_backend {
+  static constexpr unsigned entries = 256;
+
+  int _fd;
+  io_uring_params _params = {};
+  void* _sq_ring;
+  size_t _sq_ring_size;
+  void* _cq_ring;
+  size_t _cq_ring_size;
+  io_uring_sqe* _sqes;
+
+  unsigned* _sq_head;
+  unsigned* _sq_tail;
+  unsigned _sq_mask;
+  unsigned* _sq_array;
+  unsigned* _cq_head;
+  unsigned* _cq_tail;
+  unsigned _cq_mask;
+  io_uring_cqe* _cqes;
+
+  unsigned _unflushed = 0;
+
+  int _wake_fd;
+  uint64_t _wake_buf;
+  bool _wake_armed = false;
+
+public:
+  // Throws when io_uring is unavailable.
+  io_uring_backend() {
+      _fd = syscall(__NR_io_uring_setup, entries, &_params);
+      throw_system_error_on(_fd == -1, "io_uring_setup");
+      if (!(_params.features & IORING_FEAT_EXT_ARG)) {
+          // Waiting with a timeout needs Linux 5.11.
+          ::close(_fd);
+          errno = ENOSYS;
+          throw_system_error_on(true, "io_uring_setup");
+      }
+
+      _sq_ring_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+      _cq_ring_size = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+      if (_params.features & IORING_FEAT_SINGLE_MMAP) {
+          _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+      }
+      _sq_ring = map(_sq_ring_size, IORING_OFF_SQ_RING);
+      _cq_ring = (_params.features & IORING_FEAT_SINGLE_MMAP) ? _sq_ring : map(_cq_ring_size, IORING_OFF_CQ_RING);
+      _sqes = static_cast<io_uring_sqe*>(map(_params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+      auto sq = static_cast<char*>(_sq_ring);
+      _sq_head = reinterpret_cast<unsigned*>(sq + _params.sq_off.head);
+      _sq_tail = reinterpret_cast<unsigned*>(sq + _params.sq_off.tail);
+      _sq_mask = *reinterpret_cast<unsigned*>(sq + _params.sq_off.ring_mask);
+      _sq_array = reinterpret_cast<unsigned*>(sq + _params.sq_off.array);
+      auto cq = static_cast<char*>(_cq_ring);
+      _cq_head = reinterpret_cast<unsigned*>(cq + _params.cq_off.head);
+      _cq_tail = reinterpret_cast<unsigned*>(cq + _params.cq_off.tail);
+      _cq_mask = *reinterpret_cast<unsigned*>(cq + _params.cq_off.ring_mask);
+      _cqes = reinterpret_cast<io_uring_cqe*>(cq + _params.cq_off.cqes);
+
+      _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      throw_system_error_on(_wake_fd == -1, "eventfd");
+  }
+
+  ~io_uring_backend() {
+      ::close(_wake_fd);
+      munmap(_sqes, _params.sq_entries * sizeof(io_uring_sqe));
+      if (_cq_ring != _sq_ring) {
+          munmap(_cq_ring, _cq_ring_size);
+      }
+      munmap(_sq_ring, _sq_ring_size);
+      ::close(_fd);
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+  void submit(io_request& req) override {
+      auto sqe = next_sqe();
+      switch (req.kind) {
+      case io_request::op::read:
+          sqe->opcode = IORING_OP_READ;
+          sqe->addr = reinterpret_cast<uintptr_t>(req.buf);
+          sqe->len = req.len;
+          sqe->off = uint64_t(-1); // the current file position
+          break;
+      case io_request::op::write:
+          sqe->opcode = IORING_OP_WRITE;
+          sqe->addr = reinterpret_cast<uintptr_t>(req.buf);
+          sqe->len = req.len;
+          sqe->off = uint64_t(-1);
+          break;
+      case io_request::op::accept:
+          sqe->opcode = IORING_OP_ACCEPT;
+          sqe->addr = reinterpret_cast<uintptr_t>(req.addr);
+          sqe->addr2 = req.addr ? reinterpret_cast<uintptr_t>(&req.addrlen) : 0;
+          sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+          break;
+      case io_request::op::connect:
+          sqe->opcode = IORING_OP_CONNECT;
+          sqe->addr = reinterpret_cast<uintptr_t>(req.addr);
+          sqe->off = req.addrlen;
+          break;
+      }
+      sqe->fd = req.fd;
+      sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+      _inflight++;
+  }
+
+  // A submission that makes no progress, with the completion queue full or
+  // overflowed, is retried once after reaping; a second one throws EBUSY
+  // rather than spin.
+  void flush() override {
+      bool reaped = false;
+      while (_unflushed) {
+          auto r = enter(_unflushed, 0, 0, nullptr);
+          if (r == -EINTR) {
+              continue;
+          }
+          if (r > 0) {
+              _unflushed -= r;
+              reaped = false;
+              continue;
+          }
+          if (r < 0 && r != -EAGAIN && r != -EBUSY) {
+              errno = -r;
+              throw_system_error_on(true, "io_uring_enter");
+          }
+          if (reaped) {
+              errno = EBUSY;
+              throw_system_error_on(true, "io_uring_enter");
+          }
+          // Make room in the completion queue, letting the kernel move
+          // what overflowed into it first, and try again.
+          (void)enter(0, 0, IORING_ENTER_GETEVENTS, nullptr);
+          reap_completions();
+          reaped = true;
+      }
+  }
+
+  void reap(int64_t timeout_ns) override {
+      if (timeout_ns != 0 && !completions_pending()) {
+          arm_wake();
+          __kernel_timespec ts;
+          io_uring_getevents_arg arg = {};
+          arg.sigmask_sz = _NSIG / 8;
+          if (timeout_ns > 0) {
+              ts.tv_sec = timeout_ns / 1'000'000'000;
+              ts.tv_nsec = timeout_ns % 1'000'000'000;
+              arg.ts = reinterpret_cast<uintptr_t>(&ts);
+          }
+          auto r = enter(_unflushed, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+          if (r > 0) {
+              _unflushed -= r;
+          }
+      }
+      reap_completions();
+  }
+
+  bool maybe_ready() const override {
+      return completions_pending();
+  }
+
+  size_t unflushed() const override { return _unflushed; }
+
+  void wake() override {
+      uint64_t one = 1;
+      (void)!::write(_wake_fd, &one, sizeof(one));
+  }
+
+private:
+  void* map(size_t size, off_t offset) {
+      auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+      throw_system_error_on(p == MAP_FAILED, "mmap");
+      return p;
+  }
+
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags, io_uring_getevents_arg* arg) {
+      auto r = syscall(__NR_io_uring_enter, _fd, to_submit, min_complete, flags, arg, arg ? sizeof(*arg) : 0);
+      return r < 0 ? -errno : r;
+  }
+
+  io_uring_sqe* next_sqe() {
+      auto tail = *_sq_tail;
+      if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) == _params.sq_entries) {
+          flush();
+      }
+      auto index = tail & _sq_mask;
+      auto sqe = &_sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      _sq_array[index] = index;
+      __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+      _unflushed++;
+      return sqe;
+  }
+
+  bool completions_pending() const {
+      return *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+  }
+
+  // The wake-up eventfd always has a read queued while someone waits.
+  void arm_wake() {
+      if (_wake_armed) {
+          return;
+      }
+      auto sqe = next_sqe();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = _wake_fd;
+      sqe->addr = reinterpret_cast<uintptr_t>(&_wake_buf);
+      sqe->len = sizeof(_wake_buf);
+      sqe->user_data = 0;
+      _wake_armed = true;
+  }
+
+  void reap_completions() {
+      auto head = *_cq_head;
+      auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++) {
+          auto& cqe = _cqes[head & _cq_mask];
+          if (cqe.user_data == 0) {
+              _wake_armed = false;
+          } else {
+              complete(*reinterpret_cast<io_request*>(cqe.user_data), cqe.res);
+          }
+      }
+      __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+  }
+};
+
+class epoll_backend final : public reactor_backend {
+  using request_queue = intrusive_queue<io_request, &io_request::next>;
+
+  struct fd_state {
+    request_queue in;  // waiting to read or accept
+    request_queue out; // waiting to write or connect
+  };
+
+  int _epfd;
+  int _wake_fd;
+  std::unordered_map<int, fd_state> _fds;
+
+public:
+  epoll_backend() {
+      _epfd = epoll_create1(EPOLL_CLOEXEC);
+      throw_system_error_on(_epfd == -1, "epoll_create1");
+      _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      throw_system_error_on(_wake_fd == -1, "eventfd");
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = _wake_fd;
+      auto r = epoll_ctl(_epfd, EPOLL_CTL_ADD, _wake_fd, &ev);
+      throw_system_error_on(r == -1, "epoll_ctl");
+  }
+
+  ~epoll_backend() {
+      ::close(_wake_fd);
+      ::close(_epfd);
+  }
+
+  const char* name() const override { return "epoll"; }
+
+  void submit(io_request& req) override {
+      _inflight++;
+      bool in = req.kind == io_request::op::read || req.kind == io_request::op::accept;
+      auto it = _fds.find(req.fd);
+      // Behind the ones already waiting, in their order.
+      if (it == _fds.end() || (in ? it->second.in : it->second.out).empty()) {
+          auto r = attempt(req);
+          if (r != -EAGAIN) {
+              complete(req, r);
+              return;
+          }
+      }
+      auto& s = it == _fds.end() ? _fds[req.fd] : it->second;
+      (in ? s.in : s.out).push_back(req);
+      rearm(req.fd, s);
+  }
+
+  void flush() override {}
+
+  void reap(int64_t timeout_ns) override {
+      epoll_event events[64];
+      int timeout_ms = timeout_ns < 0 ? -1 : int((timeout_ns + 999'999) / 1'000'000);
+      auto n = epoll_wait(_epfd, events, 64, timeout_ms);
+      for (int i = 0; i < n; i++) {
+          auto fd = events[i].data.fd;
+          if (fd == _wake_fd) {
+              uint64_t v;
+              (void)!::read(_wake_fd, &v, sizeof(v));
+              continue;
+          }
+          auto it = _fds.find(fd);
+          if (it == _fds.end()) {
+              continue;
+          }
+          auto& s = it->second;
+          retry(s.in);
+          retry(s.out);
+          if (!s.in.empty() || !s.out.empty()) {
+              rearm(fd, s);
+          } else {
+              epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+              _fds.erase(it);
+          }
+      }
+  }
+
+  bool maybe_ready() const override { return false; }
+  size_t unflushed() const override { return 0; }
+
+  void wake() override {
+      uint64_t one = 1;
+      (void)!::write(_wake_fd, &one, sizeof(one));
+  }
+
+private:
+  static int result(ssize_t r) {
+      return r < 0 ? (errno == EWOULDBLOCK ? -EAGAIN : -errno) : int(r);
+  }
+
+  int attempt(io_request& req) {
+      switch (req.kind) {
+      case io_request::op::read:
+          return result(::read(req.fd, req.buf, req.len));
+      case io_request::op::write:
+          return result(::write(req.fd, req.buf, req.len));
+      case io_request::op::accept:
+          return result(accept4(req.fd, req.addr, req.addr ? &req.addrlen : nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK));
+      case io_request::op::connect:
+          if (!req.started) {
+              req.started = true;
+              auto r = ::connect(req.fd, req.addr, req.addrlen);
+              return r == 0 ? 0 : (errno == EINPROGRESS ? -EAGAIN : -errno);
+          } else {
+              int err = 0;
+              socklen_t len = sizeof(err);
+              getsockopt(req.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+              return -err;
+          }
+      }
+      return -EINVAL;
+  }
+
+  // Completes the waiting requests in order, up to one that would block.
+  void retry(request_queue& q) {
+      while (auto req = q.front()) {
+          auto r = attempt(*req);
+          if (r == -EAGAIN) {
+              return;
+          }
+          q.pop_front();
+          complete(*req, r);
+      }
+  }
+
+  void rearm(int fd, fd_state& s) {
+      epoll_event ev = {};
+      ev.events = EPOLLONESHOT | (s.in.empty() ? 0u : uint32_t(EPOLLIN)) | (s.out.empty() ? 0u : uint32_t(EPOLLOUT));
+      ev.data.fd = fd;
+      if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+          auto r = epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+          throw_system_error_on(r == -1, "epoll_ctl");
+      }
+  }
+};
+
+class reactor final : public poller {
+  // Flushed early once this many submissions are queued.
+  static constexpr size_t batch_size = 32;
+
+  std::unique_ptr<reactor_backend> _backend;
+
+public:
+  reactor() : _backend(make_backend()) {
+      scheduler::local().add_poller(this);
+  }
+
+  ~reactor() {
+      scheduler::local().remove_poller(this);
+  }
+
+  static reactor& local() {
+      static thread_local reactor r;
+      return r;
+  }
+
+  const char* backend_name() const { return _backend->name(); }
+  size_t inflight() const { return _backend->inflight(); }
+
+  // Called from fibers: they park until the operation is done.
+  size_t read(int fd, void* buf, size_t len) {
+      pinned<io_request> req(io_request::op::read, fd, buf, len);
+      return execute(*req, "read");
+  }
+
+  size_t write(int fd, const void* buf, size_t len) {
+      pinned<io_request> req(io_request::op::write, fd, const_cast<void*>(buf), len);
+      return execute(*req, "write");
+  }
+
+  int accept(int fd, sockaddr* addr = nullptr, socklen_t* addrlen = nullptr) {
+      pinned<io_request> req(io_request::op::accept, fd);
+      req->addr = addr;
+      req->addrlen = addrlen ? *addrlen : 0;
+      auto r = execute(*req, "accept");
+      if (addrlen) {
+          *addrlen = req->addrlen;
+      }
+      return r;
+  }
+
+  void connect(int fd, const sockaddr* addr, socklen_t addrlen) {
+      pinned<io_request> req(io_request::op::connect, fd);
+      req->addr = const_cast<sockaddr*>(addr);
+      req->addrlen = addrlen;
+      execute(*req, "connect");
+  }
+
+  bool poll() override {
+      if (_backend->unflushed() >= batch_size
+              || (_backend->unflushed() && scheduler::local().ready_count() == 0)) {
+          _backend->flush();
+      }
+      auto before = _backend->inflight();
+      if (_backend->maybe_ready() || (before && scheduler::local().ready_count() == 0)) {
+          _backend->reap(0);
+      }
+      return _backend->inflight() != before;
+  }
+
+  // Flushes submissions and waits up to timeout_ns (-1: no limit) for a
+  // completion or another thread's wake().
+  void wait(int64_t timeout_ns) {
+      _backend->flush();
+      auto start = g_counters.start_reactor_wait();
+      _backend->reap(timeout_ns);
+      g_counters.on_reactor_wait(start);
+  }
+
+  // Waits for a completion, a wake() or the next timer of this thread.
+  void idle() {
+      int64_t timeout_ns = -1;
+      if (auto next = timer_wheel::local().next_event()) {
+          auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(*next - timer::clock::now());
+          timeout_ns = std::max<int64_t>(0, left.count());
+      }
+      wait(timeout_ns);
+  }
+
+  // Callable from any thread.
+  void wake() {
+      _backend->wake();
+  }
+
+  // Runs the scheduler until no fiber is ready and neither I/O nor a timer
+  // is pending; it sleeps in idle() in between.
+  void run() {
+      auto& sched = scheduler::local();
+      auto& timers = timer_wheel::local();
+      while (true) {
+          sched.run();
+          if (!inflight() && !timers.armed()) {
+              break;
+          }
+          idle();
+      }
+  }
+
+private:
+  static std::unique_ptr<reactor_backend> make_backend() {
+#ifndef FIBER_REACTOR_EPOLL
+      try {
+          return std::make_unique<io_uring_backend>();
+      } catch (const std::system_error&) {
+          // Not supported or not permitted here.
+      }
+#endif
+      return std::make_unique<epoll_backend>();
+  }
+
+  int execute(io_request& req, const char* what) {
+      req.waiter = g_current_context;
+      _backend->submit(req);
+      auto& sched = scheduler::local();
+      while (!req.done) {
+          sched.park();
+      }
+      // Not throw_system_error_on(): a bad descriptor passed in is the
+      // caller's error to handle, not a reason to abort.
+      if (req.result < 0) {
+          throw std::system_error(-req.result, std::system_category(), what);
+      }
+      return req.result;
+  }
+};
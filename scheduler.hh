@@ -0,0 +1,503 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Single-threaded fiber scheduler.
+//
+// Each thread owns one scheduler with a FIFO queue of ready fibers per
+// fiber_class, chained through jmp_buf_link::next so enqueueing never
+// allocates. A fiber is in exactly one state at a time:
+//
+//  - ready: in its ready queue, and only then;
+//  - running: the fiber g_current_context points to;
+//  - suspended: parked, out of every queue until someone wakes it;
+//  - finished: returned from its entry function, which ends it through
+//    jmp_buf_link::end(); never run again.
+//
+// run() switches into ready fibers one at a time; a fiber gets back to it
+// through yield() (stays runnable), park() (waits for wake()) or by returning.
+// Fibers entered by run() hand off to the next ready fiber directly with
+// jmp_buf_link::switch_to() when they yield or park, so a hand-off costs one
+// switch rather than a leave() to the loop plus an enter() out of it, except
+// between two fibers of one shared_stack, which go through the loop.
+//
+// Latency-critical fibers run before background ones, which get
+// scheduler_config::background_share percent of the picks while both are
+// ready, so that they are held back but not starved. A share counts picks,
+// not time: a background fiber runs for as long as it does until it
+// switches. With scheduler_config::deadline_order each class runs its
+// fibers earliest jmp_buf_link::deadline first instead of FIFO, those
+// without one last; such a queue is a binary heap of (deadline, arrival)
+// keys, kept apart from the fibers so that ordering reads no context, on a
+// vector that allocates as it grows.
+//
+// Ready C++20 coroutines wait in a queue of their own, through a
+// coroutine_link: run() resumes those queued so far on its own stack before
+// it enters the next fiber, and a fiber that yields or parks while any are
+// queued leaves to run() rather than handing off. See coroutine.hh.
+//
+// Pollers check for outside events (messages from other shards, I/O
+// completions, ...) and wake the fibers waiting for them. They run every
+// time the scheduler picks the next fiber, on the stack of whichever
+// context makes the pick, and must not switch themselves.
+
+#pragma once
+
+#include "context.hh"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+template <typename T, T* T::*Next>
+class intrusive_queue {
+  T* _head = nullptr;
+  T* _tail = nullptr;
+  size_t _size = 0;
+
+public:
+  bool empty() const { return _head == nullptr; }
+  size_t size() const { return _size; }
+  T* front() const { return _head; }
+
+  void push_back(T& x) {
+      x.*Next = nullptr;
+      if (_tail) {
+          _tail->*Next = &x;
+      } else {
+          _head = &x;
+      }
+      _tail = &x;
+      _size++;
+  }
+
+  // Moves all of x to the back, in O(1).
+  void splice_back(intrusive_queue& x) {
+      if (x.empty()) {
+          return;
+      }
+      if (_tail) {
+          _tail->*Next = x._head;
+      } else {
+          _head = x._head;
+      }
+      _tail = x._tail;
+      _size += x._size;
+      x._head = x._tail = nullptr;
+      x._size = 0;
+  }
+
+  // O(n), for taking back a waiter that gave up.
+  bool remove(T& x) {
+      T* prev = nullptr;
+      for (auto p = _head; p; prev = p, p = p->*Next) {
+          if (p == &x) {
+              (prev ? prev->*Next : _head) = x.*Next;
+              if (_tail == &x) {
+                  _tail = prev;
+              }
+              _size--;
+              return true;
+          }
+      }
+      return false;
+  }
+
+  T* pop_front() {
+      auto x = _head;
+      if (x) {
+          _head = x->*Next;
+          if (!_head) {
+              _tail = nullptr;
+          }
+          _size--;
+      }
+      return x;
+  }
+};
+
+// Set on the threads of a work_stealing_scheduler. Its fibers migrate and
+// park and wake through it: the scheduler below, and whatever goes through
+// it (the waits of sync.hh and timer.hh, join_handle, the reactor), is not
+// for them.
+inline thread_local bool g_work_stealing_worker = false;
+
+// Thrown at a cancellation point of a fiber cancelled with
+// scheduler::cancel() to unwind its stack. Deliberately not a
+// std::exception, so that handlers for errors let it through.
+struct fiber_cancelled {};
+
+// Called from a fiber: throws fiber_cancelled, once, if the fiber has been
+// cancelled. The waits of sync.hh and timer.hh and join() are cancellation
+// points; park() is not, nor is waiting for I/O, which cannot be abandoned
+// while the kernel may still write to the fiber's stack.
+inline void cancellation_point() {
+    auto self = g_current_context;
+    if (self->cancelled) [[unlikely]] {
+        self->cancelled = false;
+        throw fiber_cancelled();
+    }
+}
+
+// Called from a fiber: the class and deadline it is queued with from its
+// next switch on, see scheduler_config.
+inline void set_fiber_class(fiber_class c) {
+    g_current_context->priority = c;
+}
+
+inline void set_deadline(std::chrono::steady_clock::time_point deadline) {
+    g_current_context->deadline = deadline;
+}
+
+// A coroutine in the ready queue. Just a handle and the queue hook, so
+// that it fits in a coroutine frame or an awaiter as is.
+struct coroutine_link {
+  std::coroutine_handle<> handle;
+  coroutine_link* next = nullptr;
+};
+
+class poller {
+public:
+  virtual ~poller() = default;
+  // Returns whether it found any work.
+  virtual bool poll() = 0;
+};
+
+struct scheduler_config {
+  // Percent of the picks background fibers get while latency-critical
+  // ones are ready too; 0 runs them only when no other fiber is ready.
+  unsigned background_share = 10;
+  bool deadline_order = false; // earliest deadline first within a class
+};
+
+// The ready fibers of one fiber_class.
+class class_queue {
+public:
+  using fifo = intrusive_queue<jmp_buf_link, &jmp_buf_link::next>;
+
+private:
+  struct entry {
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t arrival; // FIFO among equal deadlines
+    jmp_buf_link* fiber;
+
+    bool operator>(const entry& x) const {
+        return deadline != x.deadline ? deadline > x.deadline : arrival > x.arrival;
+    }
+  };
+
+  fifo _fifo;
+  std::vector<entry> _heap; // a min-heap, with deadline_order
+  uint64_t _arrivals = 0;
+  bool _by_deadline = false;
+
+public:
+  bool empty() const { return _by_deadline ? _heap.empty() : _fifo.empty(); }
+  size_t size() const { return _by_deadline ? _heap.size() : _fifo.size(); }
+
+  jmp_buf_link* front() const {
+      if (_by_deadline) {
+          return _heap.empty() ? nullptr : _heap.front().fiber;
+      }
+      return _fifo.front();
+  }
+
+  void push(jmp_buf_link& f) {
+      if (_by_deadline) {
+          _heap.push_back(entry{f.deadline, _arrivals++, &f});
+          std::push_heap(_heap.begin(), _heap.end(), std::greater<>());
+      } else {
+          _fifo.push_back(f);
+      }
+  }
+
+  void splice(fifo& batch) {
+      if (_by_deadline) {
+          while (auto f = batch.pop_front()) {
+              push(*f);
+          }
+      } else {
+          _fifo.splice_back(batch);
+      }
+  }
+
+  jmp_buf_link* pop() {
+      if (!_by_deadline) {
+          return _fifo.pop_front();
+      }
+      std::pop_heap(_heap.begin(), _heap.end(), std::greater<>());
+      auto f = _heap.back().fiber;
+      _heap.pop_back();
+      return f;
+  }
+
+  // Keeps the fibers, in the order they would have run.
+  void order_by_deadline(bool on) {
+      if (on == _by_deadline) {
+          return;
+      }
+      fifo all;
+      while (!empty()) {
+          all.push_back(*pop());
+      }
+      _by_deadline = on;
+      splice(all);
+  }
+};
+
+class scheduler {
+public:
+  using ready_queue = class_queue::fifo;
+
+private:
+  static constexpr size_t nr_classes = 2;
+
+  std::array<class_queue, nr_classes> _ready;
+  intrusive_queue<coroutine_link, &coroutine_link::next> _coroutines;
+  scheduler_config _config;
+  unsigned _background_credit = 0; // percent, see pick()
+  jmp_buf_link* _loop = nullptr; // the context inside run()
+  std::vector<poller*> _pollers;
+
+public:
+  // The calling thread's scheduler. Not on a work_stealing_scheduler
+  // worker, whose fibers this scheduler does not know about.
+  static scheduler& local() {
+      assert(!g_work_stealing_worker && "fibers of a work_stealing_scheduler use its park() and wake()");
+      static thread_local scheduler sched;
+      return sched;
+  }
+
+  void configure(const scheduler_config& config) {
+      _config = config;
+      _config.background_share = std::min(config.background_share, 100u);
+      _background_credit = 0;
+      for (auto& q : _ready) {
+          q.order_by_deadline(config.deadline_order);
+      }
+  }
+
+  const scheduler_config& config() const { return _config; }
+
+  size_t ready_count() const {
+      return _ready[size_t(fiber_class::latency)].size() + _ready[size_t(fiber_class::background)].size()
+          + _coroutines.size();
+  }
+
+  // Queues a fiber that is not running yet, or not any more.
+  void make_ready(jmp_buf_link& f) {
+      assert(f.state != fiber_state::ready && f.state != fiber_state::finished);
+      f.state = fiber_state::ready;
+      queue_of(f).push(f);
+  }
+
+  // Queues a suspended coroutine, to be resumed from run().
+  void make_ready(coroutine_link& c) {
+      _coroutines.push_back(c);
+  }
+
+  // Makes a new fiber running f(arg) on the given stack ready without
+  // switching to it; it starts when the scheduler first picks it.
+  void spawn(jmp_buf_link *ctx, void *stack, size_t stack_size, void (*f)(void *), void *arg) {
+      ctx->initialize(f, arg, stack, stack_size);
+      ctx->state = fiber_state::suspended;
+      make_ready(*ctx);
+  }
+
+  // Like spawn(), but only adds the fiber to batch, for make_ready() to
+  // queue many at once. The fibers of a batch are of one class. Needs no
+  // scheduler.
+  static void prepare(ready_queue& batch, jmp_buf_link *ctx, void *stack, size_t stack_size, void (*f)(void *), void *arg) {
+      ctx->initialize(f, arg, stack, stack_size);
+      ctx->state = fiber_state::ready;
+      batch.push_back(*ctx);
+  }
+
+  // Queues every fiber of the batch, in order, with one splice unless
+  // ordered by deadline.
+  void make_ready(ready_queue& batch) {
+      if (auto f = batch.front()) {
+          queue_of(*f).splice(batch);
+      }
+  }
+
+  void add_poller(poller* p) {
+      _pollers.push_back(p);
+  }
+
+  void remove_poller(poller* p) {
+      _pollers.erase(std::remove(_pollers.begin(), _pollers.end(), p), _pollers.end());
+  }
+
+  bool poll() {
+      bool work = false;
+      for (auto p : _pollers) {
+          work |= p->poll();
+      }
+      return work;
+  }
+
+  // Runs fibers until none is ready and the pollers find nothing to do.
+  void run() {
+      _loop = g_current_context;
+      while (true) {
+          poll();
+          if (!_coroutines.empty()) {
+              // Only those queued so far: one that reschedules itself waits
+              // for the fibers. A link may be gone once its coroutine runs.
+              decltype(_coroutines) batch;
+              batch.splice_back(_coroutines);
+              while (auto c = batch.pop_front()) {
+                  c->handle.resume();
+              }
+          }
+          if (!ready_front()) {
+              if (_coroutines.empty()) {
+                  break;
+              }
+              continue;
+          }
+          pop_next()->enter();
+      }
+      _loop = nullptr;
+  }
+
+  // Called from a fiber: lets the other ready fibers run first.
+  void yield() {
+      auto self = g_current_context;
+      poll();
+      if (!entered_by_loop(*self)) {
+          // Not entered by run(), e.g. a fiber entered by hand.
+          make_ready(*self);
+          self->leave();
+      } else if (ready_front() || !_coroutines.empty()) {
+          // Queued first, so that it competes with the others by class
+          // and deadline.
+          make_ready(*self);
+          auto front = ready_front();
+          if (!can_hand_off(*self, *front)) {
+              self->leave();
+              return;
+          }
+          auto next = pop_next();
+          if (next != self) {
+              self->switch_to(*next);
+          }
+      }
+  }
+
+  // Called from a fiber: suspends it until wake() is called on it.
+  void park() {
+      auto self = g_current_context;
+      // Suspended before polling: a poller may complete what this fiber is
+      // waiting for and wake it right away.
+      self->state = fiber_state::suspended;
+      fiber_trace(trace_kind::park, self);
+      poll();
+      auto front = ready_front();
+      if (entered_by_loop(*self) && front && can_hand_off(*self, *front)) {
+          auto next = pop_next();
+          if (next != self) {
+              self->switch_to(*next);
+          }
+      } else {
+          self->leave();
+      }
+  }
+
+  // Makes a parked fiber ready again; waking any other fiber is a no-op.
+  void wake(jmp_buf_link& f) {
+      if (f.state == fiber_state::suspended) {
+          fiber_trace(trace_kind::wake, &f);
+          make_ready(f);
+      }
+  }
+
+  // Asks a fiber to unwind: its next cancellation point throws
+  // fiber_cancelled. A parked fiber is woken to get there. A fiber of
+  // fiber.hh that has not run yet never will: it is discarded when it comes
+  // up, without a switch, and its join() throws fiber_cancelled.
+  void cancel(jmp_buf_link& f) {
+      if (f.state != fiber_state::finished) {
+          f.cancelled = true;
+          wake(f);
+      }
+  }
+
+private:
+  bool entered_by_loop(const jmp_buf_link& f) const {
+      return _loop && f.link == _loop;
+  }
+
+  // Coroutines are resumed by run() alone, so none may be waiting. The
+  // copies a switch to a fiber of a shared stack makes must not run on
+  // that stack.
+  bool can_hand_off(const jmp_buf_link& from, const jmp_buf_link& to) const {
+      return _coroutines.empty() && (&to == &from || !to.shared || to.shared != from.shared);
+  }
+
+  // The first ready fiber, once the ones ahead of it that were cancelled
+  // before they ever ran have been discarded; nullptr when none is left.
+  jmp_buf_link* ready_front() {
+      auto q = pick();
+      auto f = q ? q->front() : nullptr;
+      while (f && f->cancelled && f->discard) [[unlikely]] {
+          q->pop();
+          f->state = fiber_state::finished;
+          std::exchange(f->discard, nullptr)(f->discard_arg);
+          sanitizer_forget(*f);
+          if (f->reclaim) {
+              f->reclaim(f);
+          }
+          q = pick();
+          f = q ? q->front() : nullptr;
+      }
+      return f;
+  }
+
+  class_queue& queue_of(const jmp_buf_link& f) {
+      return _ready[size_t(f.priority)];
+  }
+
+  // The queue the next fiber comes from: the latency-critical one, unless
+  // only background fibers are ready or, while both are, the pick that
+  // brings the background credit to 100 percent.
+  class_queue* pick() {
+      auto& latency = _ready[size_t(fiber_class::latency)];
+      auto& background = _ready[size_t(fiber_class::background)];
+      if (background.empty()) [[likely]] {
+          return latency.empty() ? nullptr : &latency;
+      }
+      if (latency.empty()) {
+          return &background;
+      }
+      return _background_credit + _config.background_share >= 100 ? &background : &latency;
+  }
+
+  jmp_buf_link* pop_next() {
+      g_counters.on_ready_pop(ready_count());
+      auto q = pick();
+      auto& background = _ready[size_t(fiber_class::background)];
+      if (!background.empty() && !_ready[size_t(fiber_class::latency)].empty()) {
+          _background_credit += _config.background_share;
+          if (q == &background) {
+              _background_credit -= 100;
+          }
+      }
+      auto next = q->pop();
+      assert(next->state == fiber_state::ready);
+      next->state = fiber_state::running;
+      return next;
+  }
+};
+
+// Makes a fiber running f(ctx) on the given stack ready; like spawn(), it
+// is first switched to when the scheduler picks it.
+inline void setup(jmp_buf_link *ctx, void *stack, size_t stack_size, void (*f)(void *)) {
+    scheduler::local().spawn(ctx, stack, stack_size, f, ctx);
+}
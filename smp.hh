@@ -0,0 +1,499 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Shard-per-core mode.
+//
+// Every shard is a thread, optionally pinned to its own CPU, that runs the
+// single-threaded scheduler of scheduler.hh. Fibers never leave the shard
+// they were started on, so nothing on the fast path is shared or locked.
+// Shards talk to each other only through bounded single-producer
+// single-consumer queues, one per ordered pair of shards:
+//
+//   auto n = smp::submit_to(2, [] { return compute(); });
+//
+// called from a fiber on shard 0 puts a request for shard 2 in the 0 -> 2
+// queue and parks the calling fiber. A poller on shard 2 hands the request
+// to one of its service fibers, which runs the function and sends the
+// request back through the 2 -> 0 queue, where shard 0's poller wakes the
+// caller. The request lives on the caller's stack for the whole trip (in a
+// pinned<T>, see context.hh). A request or reply that finds its queue full
+// waits in its shard's backlog, and the caller stays parked, until the
+// other shard has made room.
+//
+// Every shard runs its own reactor, and an idle shard sleeps in it until an
+// I/O completes, a timer is due, or another shard or a thread outside the
+// smp queues work for it. Outside threads use invoke_on(), which goes through a
+// locked per-shard inbox and blocks the thread until the result is back.
+
+#pragma once
+
+#include "context.hh"
+#include "reactor.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename T, size_t Capacity>
+class spsc_queue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+  alignas(64) std::atomic<size_t> _head{0}; // next to pop, owned by the consumer
+  size_t _cached_tail = 0;
+  alignas(64) std::atomic<size_t> _tail{0}; // next to push, owned by the producer
+  size_t _cached_head = 0;
+  alignas(64) std::array<T, Capacity> _items;
+
+public:
+  // Producer only.
+  bool push(T x) {
+      auto tail = _tail.load(std::memory_order_relaxed);
+      if (tail - _cached_head == Capacity) {
+          _cached_head = _head.load(std::memory_order_acquire);
+          if (tail - _cached_head == Capacity) {
+              return false;
+          }
+      }
+      _items[tail % Capacity] = std::move(x);
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+  }
+
+  // Consumer only.
+  bool pop(T& x) {
+      auto head = _head.load(std::memory_order_relaxed);
+      if (head == _cached_tail) {
+          _cached_tail = _tail.load(std::memory_order_acquire);
+          if (head == _cached_tail) {
+              return false;
+          }
+      }
+      x = std::move(_items[head % Capacity]);
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+  }
+
+  // Producer only: whether push() would fail.
+  bool full() {
+      auto tail = _tail.load(std::memory_order_relaxed);
+      if (tail - _cached_head == Capacity) {
+          _cached_head = _head.load(std::memory_order_acquire);
+      }
+      return tail - _cached_head == Capacity;
+  }
+
+  // Consumer only.
+  bool empty() const {
+      return _head.load(std::memory_order_relaxed) == _tail.load(std::memory_order_acquire);
+  }
+};
+
+struct smp_config {
+  unsigned shards = std::max(1u, std::thread::hardware_concurrency());
+  bool pin_shards = true; // pin shard i to CPU i
+  size_t stack_size = 64 * 1024; // of the service fibers
+};
+
+class smp {
+  static constexpr size_t queue_capacity = 128;
+
+  // A cross-shard request. The concrete request type below knows how to
+  // run the function and where to keep its result.
+  struct message {
+    void (*process)(message*);
+    message* next = nullptr;
+    unsigned from = 0;
+    jmp_buf_link* waiter = nullptr; // the fiber parked in submit_to(), if any
+    std::atomic<bool> done{false};
+  };
+
+  template <typename Func>
+  struct request final : message {
+    using result_type = std::invoke_result_t<Func&>;
+    using stored_type = std::conditional_t<std::is_void_v<result_type>, bool, result_type>;
+
+    Func func;
+    std::optional<stored_type> result;
+    std::exception_ptr ex;
+
+    explicit request(Func&& f) : func(std::forward<Func>(f)) {
+        process = [] (message* m) {
+            auto self = static_cast<request*>(m);
+            try {
+                if constexpr (std::is_void_v<result_type>) {
+                    self->func();
+                    self->result.emplace(true);
+                } else {
+                    self->result.emplace(self->func());
+                }
+            } catch (...) {
+                self->ex = std::current_exception();
+            }
+        };
+    }
+
+    result_type get() {
+        if (ex) {
+            std::rethrow_exception(ex);
+        }
+        if constexpr (!std::is_void_v<result_type>) {
+            return std::move(*result);
+        }
+    }
+  };
+
+  using queue = spsc_queue<message*, queue_capacity>;
+
+  struct shard;
+
+  // Runs requests on behalf of other shards. Service fibers are started on
+  // demand and park when they run out of requests. One that is woken or new
+  // takes every pending request, so a batch starts one, and another only
+  // when a request is taken while more are pending, in case it blocks.
+  struct service_fiber {
+    jmp_buf_link context;
+    stack_ptr stack;
+    shard* owner;
+    service_fiber* next_idle = nullptr;
+  };
+
+  struct shard final : poller {
+    smp& group;
+    const unsigned id;
+    std::thread thread;
+
+    // incoming[i] carries requests from shard i, replies[i] carries our
+    // requests back from shard i.
+    std::vector<std::unique_ptr<queue>> incoming;
+    std::vector<std::unique_ptr<queue>> replies;
+
+    std::mutex inbox_mutex;
+    intrusive_queue<message, &message::next> inbox; // from outside the smp
+    std::atomic<size_t> inbox_size{0};
+
+    intrusive_queue<message, &message::next> pending; // waiting for a service fiber
+    service_fiber* idle_services = nullptr;
+    unsigned starting_services = 0; // woken or new, not yet at pending
+    std::vector<std::unique_ptr<service_fiber>> services;
+
+    // backlog[i] holds replies for shard i that found its queue full, and
+    // request_backlog[i] requests for it; shard i notifies this shard when
+    // it has made room in either queue, and poll() sends them then.
+    std::vector<intrusive_queue<message, &message::next>> backlog;
+    std::vector<intrusive_queue<message, &message::next>> request_backlog;
+    std::atomic<bool> backlogged{false};
+
+    // The shard thread's reactor while it runs. Guarded, so that the thread
+    // cannot destroy it under a notify() from another one.
+    std::mutex io_mutex;
+    reactor* io = nullptr;
+    std::atomic<bool> sleeping{false};
+
+    shard(smp& g, unsigned i) : group(g), id(i) {}
+
+    bool has_work() const {
+        if (inbox_size.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        for (unsigned i = 0; i < incoming.size(); i++) {
+            if (!incoming[i]->empty() || !replies[i]->empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool poll() override {
+        bool work = false;
+        message* m;
+        for (unsigned i = 0; i < incoming.size(); i++) {
+            bool popped = false;
+            while (incoming[i]->pop(m)) {
+                dispatch(m);
+                popped = true;
+            }
+            while (replies[i]->pop(m)) {
+                m->done.store(true, std::memory_order_relaxed);
+                scheduler::local().wake(*m->waiter);
+                popped = true;
+            }
+            if (popped) {
+                work = true;
+                // Pairs with the fence in sleep().
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto& from = *group._shards[i];
+                if (from.backlogged.load(std::memory_order_relaxed)) {
+                    from.notify();
+                }
+            }
+        }
+        if (inbox_size.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            while (auto m = inbox.pop_front()) {
+                inbox_size.fetch_sub(1, std::memory_order_relaxed);
+                dispatch(m);
+            }
+            work = true;
+        }
+        if (!pending.empty() && !starting_services) {
+            start_service();
+        }
+        if (backlogged.load(std::memory_order_relaxed) && flush_backlog()) {
+            work = true;
+        }
+        return work;
+    }
+
+    void dispatch(message* m) {
+        pending.push_back(*m);
+    }
+
+    void start_service() {
+        starting_services++;
+        if (auto s = idle_services) {
+            idle_services = s->next_idle;
+            scheduler::local().wake(s->context);
+            return;
+        }
+        auto s = std::make_unique<service_fiber>();
+        s->stack = make_stack(group._config.stack_size);
+        s->owner = this;
+        scheduler::local().spawn(&s->context, s->stack.get(), group._config.stack_size, &run_service, s.get());
+        services.push_back(std::move(s));
+    }
+
+    static void run_service(void* arg) {
+        MAKE_FRAME();
+        auto self = static_cast<service_fiber*>(arg);
+        auto& sh = *self->owner;
+        auto& sched = scheduler::local();
+        while (true) {
+            sh.starting_services--;
+            while (auto m = sh.pending.pop_front()) {
+                if (!sh.pending.empty() && !sh.starting_services) {
+                    sh.start_service();
+                }
+                m->process(m);
+                sh.reply(m);
+            }
+            self->next_idle = sh.idle_services;
+            sh.idle_services = self;
+            sched.park();
+        }
+    }
+
+    void reply(message* m) {
+        if (!m->waiter) {
+            m->done.store(true, std::memory_order_release);
+            m->done.notify_one();
+            return;
+        }
+        auto& to = *group._shards[m->from];
+        send(to, *to.replies[id], backlog[m->from], m);
+    }
+
+    // Called from a fiber of this shard, which then parks until the reply.
+    void request(message* m, unsigned to_id) {
+        auto& to = *group._shards[to_id];
+        send(to, *to.incoming[id], request_backlog[to_id], m);
+    }
+
+    // Pushes m to shard to through q, unless q is full or messages wait in
+    // the backlog before it: then m waits behind them.
+    void send(shard& to, queue& q, intrusive_queue<message, &message::next>& waiting, message* m) {
+        if (!waiting.empty() || !q.push(m)) {
+            waiting.push_back(*m);
+            backlogged.store(true, std::memory_order_relaxed);
+            return;
+        }
+        to.notify();
+    }
+
+    // Sends what fits of the backlogs; whether it sent anything.
+    bool flush_backlog() {
+        bool sent = false;
+        bool left = false;
+        for (unsigned i = 0; i < backlog.size(); i++) {
+            auto& to = *group._shards[i];
+            bool pushed = flush(*to.replies[id], backlog[i]);
+            pushed |= flush(*to.incoming[id], request_backlog[i]);
+            if (pushed) {
+                to.notify();
+            }
+            sent |= pushed;
+            left |= !backlog[i].empty() || !request_backlog[i].empty();
+        }
+        backlogged.store(left, std::memory_order_relaxed);
+        return sent;
+    }
+
+    static bool flush(queue& q, intrusive_queue<message, &message::next>& waiting) {
+        bool pushed = false;
+        // Unlinked before the push: the message may be gone right after.
+        while (!waiting.empty() && !q.full()) {
+            q.push(waiting.pop_front());
+            pushed = true;
+        }
+        return pushed;
+    }
+
+    // Called after queueing work for this shard from anywhere else.
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(io_mutex);
+            if (io) {
+                io->wake();
+            }
+        }
+    }
+
+    void sleep() {
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work() && !(backlogged.load(std::memory_order_relaxed) && flush_backlog())
+            && !group._stopping.load(std::memory_order_relaxed)) {
+            // A wake() racing with this still ends the wait.
+            reactor::local().idle();
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    void run() {
+        init();
+        guarded_stack_source::install_overflow_handler();
+        t_shard = this;
+        if (group._config.pin_shards) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(id % CPU_SETSIZE, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+        auto& sched = scheduler::local();
+        {
+            std::lock_guard<std::mutex> lock(io_mutex);
+            io = &reactor::local();
+        }
+        sched.add_poller(this);
+        while (!group._stopping.load(std::memory_order_relaxed)) {
+            sched.run();
+            sleep();
+        }
+        sched.remove_poller(this);
+        services.clear();
+        t_shard = nullptr;
+        // The reactor goes with the thread; wait out the notify()s using it.
+        std::lock_guard<std::mutex> lock(io_mutex);
+        io = nullptr;
+    }
+  };
+
+  static inline thread_local shard* t_shard;
+
+  const smp_config _config;
+  std::vector<std::unique_ptr<shard>> _shards;
+  std::atomic<bool> _stopping{false};
+
+public:
+  explicit smp(smp_config config = {}) : _config(config) {
+      for (unsigned i = 0; i < _config.shards; i++) {
+          _shards.push_back(std::make_unique<shard>(*this, i));
+      }
+      for (auto& s : _shards) {
+          for (unsigned i = 0; i < _config.shards; i++) {
+              s->incoming.push_back(std::make_unique<queue>());
+              s->replies.push_back(std::make_unique<queue>());
+          }
+          s->backlog.resize(_config.shards);
+          s->request_backlog.resize(_config.shards);
+      }
+      for (auto& s : _shards) {
+          s->thread = std::thread([s = s.get()] { s->run(); });
+      }
+  }
+
+  smp(const smp&) = delete;
+  smp& operator=(const smp&) = delete;
+
+  ~smp() {
+      stop();
+  }
+
+  unsigned count() const { return _shards.size(); }
+
+  // The shard of the calling thread; only valid on a shard.
+  static unsigned this_shard() {
+      assert(t_shard);
+      return t_shard->id;
+  }
+
+  // Called from a fiber on a shard: runs func() in a fiber on the given
+  // shard and returns its result, or rethrows what it threw. The caller is
+  // parked until the result arrives.
+  template <typename Func>
+  static auto submit_to(unsigned to, Func&& func) -> std::invoke_result_t<Func&> {
+      auto from = t_shard;
+      assert(from && "use smp::invoke_on() outside of a shard");
+      if (from->id == to) {
+          return func();
+      }
+      return from->group.submit(from, to, std::forward<Func>(func));
+  }
+
+  // submit_to() for threads that are not shards of this smp.
+  template <typename Func>
+  auto invoke_on(unsigned to, Func&& func) -> std::invoke_result_t<Func&> {
+      return submit(t_shard, to, std::forward<Func>(func));
+  }
+
+  // Stops the shards once they are idle and joins them.
+  void stop() {
+      if (_stopping.exchange(true)) {
+          return;
+      }
+      for (auto& s : _shards) {
+          s->notify();
+      }
+      for (auto& s : _shards) {
+          s->thread.join();
+      }
+  }
+
+private:
+  template <typename Func>
+  auto submit(shard* from, unsigned to, Func&& func) -> std::invoke_result_t<Func&> {
+      assert(to < _shards.size());
+      pinned<request<Func>> req(std::forward<Func>(func));
+      auto& target = *_shards[to];
+      if (from && &from->group == this) {
+          req->from = from->id;
+          req->waiter = g_current_context;
+          auto& sched = scheduler::local();
+          from->request(&*req, to);
+          while (!req->done.load(std::memory_order_relaxed)) {
+              sched.park();
+          }
+      } else {
+          {
+              std::lock_guard<std::mutex> lock(target.inbox_mutex);
+              target.inbox.push_back(*req);
+              target.inbox_size.fetch_add(1, std::memory_order_relaxed);
+          }
+          target.notify();
+          req->done.wait(false, std::memory_order_acquire);
+      }
+      return req->get();
+  }
+};
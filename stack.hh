@@ -0,0 +1,737 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Fiber stack allocation.
+//
+// Stack memory comes from a stack_source and is recycled through a per-thread
+// stack_pool: a released stack goes back to the pool of the thread that
+// releases it and is handed out again by the next make_stack() of the same
+// size class. The pool is only ever touched by its own thread, so neither
+// path takes a lock.
+//
+// The default source is guarded_stack_source: stacks carved out of one big
+// mmap() reservation, each with a PROT_NONE guard page below it. Pages are
+// committed by the kernel as the fiber touches them, so a generous stack
+// costs only what is used, and an overflow faults on the guard page instead
+// of running into a neighbour.
+//
+// huge_page_stack_source is the alternative for very many small stacks:
+// they are carved back to back out of 2 MiB huge pages bound to the NUMA
+// node of the thread that asks for the source, so switching between
+// thousands of fibers costs few TLB entries. It has no guard pages.
+//
+// stack_profiler measures how much stack fibers really use: when enabled,
+// spawn() paints each new stack with a canary and the deepest word that
+// lost it, found once the fiber has finished, is recorded against the
+// fiber's entry point. The peaks are for picking per-site stack sizes.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+inline size_t page_size() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Where stack memory comes from when the pool has none to recycle.
+class stack_source {
+public:
+  virtual ~stack_source() = default;
+  virtual char* allocate(size_t size) = 0;
+  virtual void deallocate(char* ptr, size_t size) noexcept = 0;
+};
+
+struct stack_release {
+  size_t size = 0;
+  stack_source* source = nullptr;
+
+  void operator()(char *ptr) const noexcept;
+};
+
+using stack_ptr = std::unique_ptr<char[], stack_release>;
+
+inline
+void throw_system_error_on(bool condition, const char* what_arg) {
+  if (condition) {
+    if ((errno == EBADF || errno == ENOTSOCK)) {
+        abort();
+    }
+    throw std::system_error(errno, std::system_category(), what_arg);
+  }
+}
+
+inline void* alligned_alloc(size_t size, size_t align) {
+  void *ret;
+  auto r = posix_memalign(&ret, align, size);
+  if (r == ENOMEM) {
+    throw std::bad_alloc();
+  } else if (r == EINVAL) {
+    throw std::runtime_error(fmt::format("Invalid alignment of {:d}; allocating {:d} bytes", align, size));
+  } else {
+    assert(r == 0);
+    return ret;
+  }
+}
+
+// Page-aligned stacks from the global allocator.
+class heap_stack_source final : public stack_source {
+public:
+  static heap_stack_source& instance() {
+      static heap_stack_source source;
+      return source;
+  }
+
+  char* allocate(size_t size) override {
+      return static_cast<char*>(alligned_alloc(size, page_size()));
+  }
+
+  void deallocate(char* ptr, size_t) noexcept override {
+      free(ptr);
+  }
+};
+
+// Stacks carved out of a single PROT_NONE reservation. Every stack gets a
+// guard page right below it that stays PROT_NONE; the stack itself is made
+// read-write but only backed by memory once touched. Released stacks have
+// their pages dropped and are reused for the next stack of the same size.
+//
+// Each guard splits the reservation, so every stack costs two mappings and
+// a process has vm.max_map_count (65530 by default) of them: once about
+// 32k stacks have been carved out, allocate() throws std::system_error
+// with ENOMEM. Raise the sysctl for more, or take the stacks from a
+// huge_page_stack_source, which has no guards.
+//
+// The source is shared by all threads; the mutex is only taken when the
+// per-thread pools miss.
+class guarded_stack_source final : public stack_source {
+  static constexpr size_t default_reserve = size_t(64) << 30;
+
+  char* _begin;
+  char* _end;
+  char* _next;
+  std::mutex _mutex;
+  std::unordered_map<size_t, std::vector<char*>> _free;
+
+public:
+  explicit guarded_stack_source(size_t reserve = default_reserve) {
+      auto mem = mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      throw_system_error_on(mem == MAP_FAILED, "mmap");
+      _begin = _next = static_cast<char*>(mem);
+      _end = _begin + reserve;
+  }
+
+  ~guarded_stack_source() {
+      munmap(_begin, _end - _begin);
+  }
+
+  // Never destroyed: stacks held by objects of static or thread storage
+  // duration are released back to it during exit.
+  static guarded_stack_source& instance() {
+      static auto source = new guarded_stack_source();
+      return *source;
+  }
+
+  char* allocate(size_t size) override {
+      size = align_up(size);
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& free = _free[size];
+      if (!free.empty()) {
+          auto stack = free.back();
+          free.pop_back();
+          return stack;
+      }
+      if (size_t(_end - _next) < size + page_size()) {
+          throw std::bad_alloc();
+      }
+      auto stack = _next + page_size();
+      auto r = mprotect(stack, size, PROT_READ | PROT_WRITE);
+      throw_system_error_on(r == -1, "mprotect");
+      _next = stack + size;
+      return stack;
+  }
+
+  void deallocate(char* ptr, size_t size) noexcept override {
+      size = align_up(size);
+      (void)madvise(ptr, size, MADV_DONTNEED);
+      std::lock_guard<std::mutex> lock(_mutex);
+      try {
+          _free[size].push_back(ptr);
+      } catch (...) {
+          // The stack stays reserved but unused.
+      }
+  }
+
+  bool contains(const void* addr) const {
+      return addr >= _begin && addr < _end;
+  }
+
+  // Reports a fault on a guard page as a fiber stack overflow, naming the
+  // overflowed stack, and aborts. Installs the handler for the process and
+  // an alternate signal stack for the calling thread; every thread that runs
+  // fibers should call it, as the threads of work_stealing_scheduler and
+  // smp do. Faults elsewhere go to the previous handler.
+  static void install_overflow_handler() {
+      static std::once_flag once;
+      std::call_once(once, [] {
+          instance();
+          struct sigaction sa = {};
+          sa.sa_sigaction = &on_segv;
+          sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+          sigemptyset(&sa.sa_mask);
+          auto r = sigaction(SIGSEGV, &sa, &previous_action());
+          throw_system_error_on(r == -1, "sigaction");
+      });
+
+      struct altstack {
+        std::unique_ptr<char[]> mem;
+
+        altstack() : mem(new char[SIGSTKSZ * 4]) {
+            stack_t ss = {};
+            ss.ss_sp = mem.get();
+            ss.ss_size = SIGSTKSZ * 4;
+            auto r = sigaltstack(&ss, nullptr);
+            throw_system_error_on(r == -1, "sigaltstack");
+        }
+
+        ~altstack() {
+            stack_t ss = {};
+            ss.ss_flags = SS_DISABLE;
+            sigaltstack(&ss, nullptr);
+        }
+      };
+      static thread_local altstack stack;
+  }
+
+private:
+  static size_t align_up(size_t size) {
+      return (size + page_size() - 1) & ~(page_size() - 1);
+  }
+
+  static struct sigaction& previous_action() {
+      static struct sigaction action;
+      return action;
+  }
+
+  static void on_segv(int signo, siginfo_t* info, void* uctx) {
+      auto addr = info->si_addr;
+      if (instance().contains(addr)) {
+          // Guard pages are exactly one page below their stack.
+          auto stack = (reinterpret_cast<uintptr_t>(addr) + page_size()) & ~(page_size() - 1);
+          char buf[128];
+          size_t n = 0;
+          auto put = [&] (const char* s) {
+              while (*s && n < sizeof(buf)) {
+                  buf[n++] = *s++;
+              }
+          };
+          auto put_hex = [&] (uintptr_t v) {
+              put("0x");
+              for (int shift = 60; shift >= 0; shift -= 4) {
+                  if (n < sizeof(buf)) {
+                      buf[n++] = "0123456789abcdef"[(v >> shift) & 0xf];
+                  }
+              }
+          };
+          put("fiber stack overflow: fault at ");
+          put_hex(reinterpret_cast<uintptr_t>(addr));
+          put(", stack bottom ");
+          put_hex(stack);
+          put("\n");
+          (void)!write(STDERR_FILENO, buf, n);
+          abort();
+      }
+      auto& prev = previous_action();
+      if (prev.sa_flags & SA_SIGINFO) {
+          prev.sa_sigaction(signo, info, uctx);
+      } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+          prev.sa_handler(signo);
+      } else {
+          // Returning re-executes the faulting access with the default action.
+          signal(SIGSEGV, SIG_DFL);
+      }
+  }
+};
+
+struct huge_page_stack_config {
+  size_t chunk_size = size_t(64) << 20; // mapped at a time, in huge pages
+  // MAP_HUGETLB pages from the reserved pool (vm.nr_hugepages) instead of
+  // transparent huge pages; falls back to the latter when none are left.
+  bool explicit_pages = false;
+};
+
+// Stacks carved contiguously out of huge-page chunks, with no guard pages
+// in between, since a guard would split the huge page it is in. An
+// overflow runs into the neighbouring stack: size the stacks with
+// stack_profiler first. Released stacks are kept for the next stack of
+// the same size; their memory is never given back, as dropping parts of
+// a huge page would split it too. Give the pool stack_advice::none. Pages
+// are committed 2 MiB at a time, so a stack costs its full size rather
+// than what the fiber touches; in return there is no mapping per stack,
+// and the number of stacks is not bounded by vm.max_map_count.
+class huge_page_stack_source final : public stack_source {
+  static constexpr size_t huge_page_size = size_t(2) << 20;
+  static constexpr int max_nodes = 64;
+
+  const huge_page_stack_config _config;
+  const int _node; // -1: not bound
+  std::mutex _mutex;
+  char* _next = nullptr;
+  char* _end = nullptr;
+  std::vector<std::pair<char*, size_t>> _chunks;
+  std::unordered_map<size_t, std::vector<char*>> _free;
+
+public:
+  explicit huge_page_stack_source(huge_page_stack_config config = {}, int node = -1)
+      : _config(config), _node(node) {}
+
+  ~huge_page_stack_source() {
+      for (auto [p, size] : _chunks) {
+          munmap(p, size);
+      }
+  }
+
+  huge_page_stack_source(const huge_page_stack_source&) = delete;
+  huge_page_stack_source& operator=(const huge_page_stack_source&) = delete;
+
+  // The source of the calling thread's NUMA node, created with config by
+  // the first thread of the node to ask, and never destroyed, like
+  // guarded_stack_source::instance(). Call it from the thread that will
+  // run the fibers, after pinning it:
+  //
+  //   stack_pool::local().configure({}, &huge_page_stack_source::local());
+  static huge_page_stack_source& local(const huge_page_stack_config& config = {}) {
+      static std::mutex mutex;
+      static std::array<huge_page_stack_source*, max_nodes> nodes;
+      unsigned cpu, node;
+      if (getcpu(&cpu, &node) != 0 || node >= max_nodes) {
+          node = 0;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      auto& source = nodes[node];
+      if (!source) {
+          source = new huge_page_stack_source(config, int(node));
+      }
+      return *source;
+  }
+
+  int node() const { return _node; }
+
+  char* allocate(size_t size) override {
+      size = (size + page_size() - 1) & ~(page_size() - 1);
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& free = _free[size];
+      if (!free.empty()) {
+          auto stack = free.back();
+          free.pop_back();
+          return stack;
+      }
+      if (size_t(_end - _next) < size) {
+          map_chunk(std::max(_config.chunk_size, size));
+      }
+      auto stack = _next;
+      _next += size;
+      return stack;
+  }
+
+  void deallocate(char* ptr, size_t size) noexcept override {
+      size = (size + page_size() - 1) & ~(page_size() - 1);
+      std::lock_guard<std::mutex> lock(_mutex);
+      try {
+          _free[size].push_back(ptr);
+      } catch (...) {
+          // The stack stays mapped but unused.
+      }
+  }
+
+private:
+  // The tail of the current chunk is abandoned.
+  void map_chunk(size_t size) {
+      size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+      void* mem = MAP_FAILED;
+      if (_config.explicit_pages) {
+          mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+      }
+      if (mem == MAP_FAILED) {
+          // Over-map to cut out a huge-page aligned chunk.
+          auto raw = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          throw_system_error_on(raw == MAP_FAILED, "mmap");
+          auto begin = reinterpret_cast<uintptr_t>(raw);
+          auto aligned = (begin + huge_page_size - 1) & ~(huge_page_size - 1);
+          if (aligned != begin) {
+              munmap(raw, aligned - begin);
+          }
+          munmap(reinterpret_cast<char*>(aligned) + size, begin + huge_page_size - aligned);
+          mem = reinterpret_cast<void*>(aligned);
+          // Best effort, as is everything below: without it the stacks
+          // merely use small pages.
+          (void)madvise(mem, size, MADV_HUGEPAGE);
+      }
+      bind(mem, size);
+      _chunks.emplace_back(static_cast<char*>(mem), size);
+      _next = static_cast<char*>(mem);
+      _end = _next + size;
+  }
+
+  // Before the first touch, so the pages come from the node.
+  void bind(void* mem, size_t size) const {
+      if (_node < 0) {
+          return;
+      }
+      constexpr int mpol_preferred = 1;
+      uint64_t mask = uint64_t(1) << _node;
+      (void)syscall(SYS_mbind, mem, size, mpol_preferred, &mask, sizeof(mask) * 8 + 1, 0);
+  }
+};
+
+// What the pool tells the kernel about the memory of a stack it keeps idle.
+enum class stack_advice {
+  none,     // keep it resident
+  dontneed, // MADV_DONTNEED: drop the pages now
+  free,     // MADV_FREE: let the kernel reclaim them under memory pressure
+};
+
+struct stack_pool_config {
+  size_t max_idle_per_class = 64;
+  stack_advice advice = stack_advice::none;
+};
+
+struct stack_pool_stats {
+  uint64_t hits = 0;       // allocations served from an idle stack
+  uint64_t misses = 0;     // allocations that went to the stack source
+  size_t idle_stacks = 0;
+  size_t resident_bytes = 0; // idle stack memory the pool keeps resident
+};
+
+class stack_pool {
+public:
+  // Size classes are powers of two from min_class_size up; bigger stacks
+  // bypass the pool.
+  static constexpr size_t min_class_size = 4096;
+  static constexpr size_t nr_classes = 8;
+  static constexpr size_t max_class_size = min_class_size << (nr_classes - 1);
+
+private:
+  // Idle stacks are chained through their topmost word. The topmost page is
+  // never advised away, so the link survives and the page the next user
+  // touches first is already there.
+  struct idle_stack {
+    idle_stack* next;
+  };
+
+  struct size_class {
+    idle_stack* head = nullptr;
+    size_t count = 0;
+  };
+
+  std::array<size_class, nr_classes> _classes;
+  stack_source* _source = &guarded_stack_source::instance();
+  stack_pool_config _config;
+  stack_pool_stats _stats;
+
+public:
+  stack_pool() = default;
+  stack_pool(const stack_pool&) = delete;
+  stack_pool& operator=(const stack_pool&) = delete;
+  ~stack_pool() { trim(); }
+
+  static stack_pool& local() {
+      static thread_local stack_pool pool;
+      return pool;
+  }
+
+  // Drops the idle stacks, they may not fit the new configuration.
+  void configure(const stack_pool_config& config, stack_source* source = nullptr) {
+      trim();
+      if (source) {
+          _source = source;
+      }
+      _config = config;
+  }
+
+  stack_source* source() const { return _source; }
+  const stack_pool_stats& stats() const { return _stats; }
+
+  stack_ptr allocate(size_t size) {
+      auto cls = class_of(size);
+      if (cls == nr_classes) {
+          _stats.misses++;
+          return stack_ptr(_source->allocate(size), stack_release{size, _source});
+      }
+      auto class_size = min_class_size << cls;
+      auto& c = _classes[cls];
+      if (c.head) {
+          auto s = std::exchange(c.head, c.head->next);
+          c.count--;
+          _stats.hits++;
+          _stats.idle_stacks--;
+          _stats.resident_bytes -= resident_size(class_size);
+          auto bottom = reinterpret_cast<char*>(s) + sizeof(idle_stack) - class_size;
+          return stack_ptr(bottom, stack_release{class_size, _source});
+      }
+      _stats.misses++;
+      return stack_ptr(_source->allocate(class_size), stack_release{class_size, _source});
+  }
+
+  class batch;
+
+  // n stacks of the given size for batch::take() to hand out, looking the
+  // size class up and counting the idle stacks it hands out once. The idle
+  // ones are moved to the batch right away, so that allocations made while
+  // it is being taken from (say, for a fiber's arena) cannot get them.
+  batch allocate(size_t size, size_t n);
+
+  void release(char* ptr, size_t size, stack_source* source) noexcept {
+      auto cls = class_of(size);
+      if (source != _source || cls == nr_classes || (min_class_size << cls) != size) {
+          source->deallocate(ptr, size);
+          return;
+      }
+      auto& c = _classes[cls];
+      if (c.count >= _config.max_idle_per_class) {
+          source->deallocate(ptr, size);
+          return;
+      }
+      advise(ptr, size);
+      auto s = reinterpret_cast<idle_stack*>(ptr + size - sizeof(idle_stack));
+      s->next = c.head;
+      c.head = s;
+      c.count++;
+      _stats.idle_stacks++;
+      _stats.resident_bytes += resident_size(size);
+  }
+
+  // Gives every idle stack back to the source.
+  void trim() noexcept {
+      for (size_t cls = 0; cls < nr_classes; cls++) {
+          auto class_size = min_class_size << cls;
+          auto& c = _classes[cls];
+          while (c.head) {
+              auto s = std::exchange(c.head, c.head->next);
+              _source->deallocate(reinterpret_cast<char*>(s) + sizeof(idle_stack) - class_size, class_size);
+          }
+          c.count = 0;
+      }
+      _stats.idle_stacks = 0;
+      _stats.resident_bytes = 0;
+  }
+
+private:
+  static size_t class_of(size_t size) {
+      size_t cls = 0;
+      while (cls < nr_classes && (min_class_size << cls) < size) {
+          cls++;
+      }
+      return cls;
+  }
+
+  // Counts n idle stacks of the given size as handed out.
+  void count_idle(size_t n, size_t size) {
+      _stats.hits += n;
+      _stats.idle_stacks -= n;
+      _stats.resident_bytes -= n * resident_size(size);
+  }
+
+  size_t resident_size(size_t size) const {
+      return _config.advice == stack_advice::none ? size : page_size();
+  }
+
+  void advise(char* ptr, size_t size) const noexcept {
+      if (_config.advice == stack_advice::none || size <= page_size()) {
+          return;
+      }
+      auto advice = _config.advice == stack_advice::dontneed ? MADV_DONTNEED : MADV_FREE;
+      // Best effort: on failure the memory merely stays resident.
+      (void)madvise(ptr, size - page_size(), advice);
+  }
+};
+
+class stack_pool::batch {
+  stack_pool& _pool;
+  size_t _size;
+  size_t _left;
+  idle_stack* _idle; // taken off the size class and counted as hits already
+  size_t _nr_idle;
+
+  friend class stack_pool;
+
+  batch(stack_pool& pool, size_t size, size_t n, idle_stack* idle, size_t nr_idle)
+      : _pool(pool), _size(size), _left(n), _idle(idle), _nr_idle(nr_idle) {}
+
+public:
+  batch(const batch&) = delete;
+  batch& operator=(const batch&) = delete;
+
+  // Gives back the idle stacks it did not hand out.
+  ~batch() {
+      _pool._stats.hits -= _nr_idle;
+      while (_idle) {
+          auto s = std::exchange(_idle, _idle->next);
+          _pool.release(reinterpret_cast<char*>(s) + sizeof(idle_stack) - _size, _size, _pool._source);
+      }
+  }
+
+  size_t size() const { return _left; }
+
+  stack_ptr take() {
+      assert(_left);
+      _left--;
+      if (_idle) {
+          _nr_idle--;
+          auto s = std::exchange(_idle, _idle->next);
+          auto bottom = reinterpret_cast<char*>(s) + sizeof(idle_stack) - _size;
+          return stack_ptr(bottom, stack_release{_size, _pool._source});
+      }
+      _pool._stats.misses++;
+      return stack_ptr(_pool._source->allocate(_size), stack_release{_size, _pool._source});
+  }
+};
+
+inline stack_pool::batch stack_pool::allocate(size_t size, size_t n) {
+    auto cls = class_of(size);
+    if (cls == nr_classes) {
+        return batch(*this, size, n, nullptr, 0);
+    }
+    auto class_size = min_class_size << cls;
+    auto& c = _classes[cls];
+    auto nr_idle = std::min(n, c.count);
+    auto idle = c.head;
+    auto last = idle;
+    for (size_t i = 1; i < nr_idle; i++) {
+        last = last->next;
+    }
+    if (nr_idle) {
+        c.head = std::exchange(last->next, nullptr);
+    } else {
+        idle = nullptr;
+    }
+    c.count -= nr_idle;
+    count_idle(nr_idle, class_size);
+    return batch(*this, class_size, n, idle, nr_idle);
+}
+
+inline void stack_release::operator()(char *ptr) const noexcept {
+    stack_pool::local().release(ptr, size, source);
+}
+
+// Stacks are at least stack_size bytes and page aligned.
+inline stack_ptr make_stack(size_t stack_size) {
+    return stack_pool::local().allocate(stack_size);
+}
+
+// n stacks for make_stack(stack_size) to hand out, in one trip to the pool.
+inline stack_pool::batch make_stacks(size_t stack_size, size_t n) {
+    return stack_pool::local().allocate(stack_size, n);
+}
+
+struct stack_usage {
+  std::string entry;
+  uint64_t fibers = 0;
+  size_t stack_size = 0; // the largest any of them had
+  size_t peak = 0;       // the most bytes any of them used
+  size_t total = 0;      // summed over the fibers, for the mean
+};
+
+// Process-wide; only spawns and endings of fibers while it is enabled touch
+// it, and each takes its mutex once.
+class stack_profiler {
+  static constexpr uint64_t canary = 0x5ca1ab1e5ca1ab1eull;
+
+  std::atomic<bool> _enabled = false;
+  mutable std::mutex _mutex;
+  std::map<std::string, stack_usage, std::less<>> _usage;
+
+public:
+  static stack_profiler& instance() {
+      static stack_profiler profiler;
+      return profiler;
+  }
+
+  // Affects fibers spawned from then on. Painting commits the whole stack,
+  // so it is a diagnostic mode, not one to run with in production.
+  void enable(bool on = true) { _enabled.store(on, std::memory_order_relaxed); }
+  bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+  // Fills [bottom, bottom + size) with the canary.
+  static void paint(char* bottom, size_t size) {
+      for (size_t i = 0; i + sizeof(canary) <= size; i += sizeof(canary)) {
+          std::memcpy(bottom + i, &canary, sizeof(canary));
+      }
+  }
+
+  // How many bytes below bottom + size were written since paint(). Reads
+  // dead stack frames, hence no ASan.
+  [[gnu::no_sanitize_address]] static size_t measure(const char* bottom, size_t size) {
+      size_t i = 0;
+      for (; i + sizeof(canary) <= size; i += sizeof(canary)) {
+          uint64_t word;
+          std::memcpy(&word, bottom + i, sizeof(word));
+          if (word != canary) {
+              break;
+          }
+      }
+      return size - i;
+  }
+
+  // Called once the fiber that ran on a painted stack has finished.
+  void record(std::string_view entry, size_t stack_size, size_t used) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _usage.find(entry);
+      if (it == _usage.end()) {
+          it = _usage.emplace(std::string(entry), stack_usage{.entry = std::string(entry)}).first;
+      }
+      auto& u = it->second;
+      u.fibers++;
+      u.stack_size = std::max(u.stack_size, stack_size);
+      u.peak = std::max(u.peak, used);
+      u.total += used;
+  }
+
+  std::vector<stack_usage> snapshot() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<stack_usage> v;
+      v.reserve(_usage.size());
+      for (auto& [_, u] : _usage) {
+          v.push_back(u);
+      }
+      return v;
+  }
+
+  void reset() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _usage.clear();
+  }
+
+  // One line per entry point: entry,fibers,stack_size,peak,mean.
+  void write_csv(std::FILE* out) const {
+      fmt::print(out, "entry,fibers,stack_size,peak,mean\n");
+      for (auto& u : snapshot()) {
+          fmt::print(out, "\"{}\",{},{},{},{}\n", u.entry, u.fibers, u.stack_size, u.peak, u.total / u.fibers);
+      }
+  }
+};
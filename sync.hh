@@ -0,0 +1,322 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Fiber synchronization.
+//
+// fiber_mutex, fiber_condition_variable, fiber_semaphore and channel<T>
+// park the calling fiber instead of blocking its thread. They are meant for
+// the fibers of one scheduler thread, like the scheduler itself, and need
+// neither atomics nor locks; not for the fibers of a work_stealing_scheduler,
+// which migrate between threads.
+//
+// Whatever a fiber waits for is handed to it directly by the fiber that
+// releases it: unlock() passes the mutex to the next waiter, signal() passes
+// units of the semaphore, send() passes the value into a waiting receiver.
+// A woken fiber therefore never finds its prize taken and never has to
+// retry, and waking one fiber wakes only that one. notify_all() moves the
+// waiters of a condition variable onto the queue of its mutex rather than
+// waking them all to fight over it.
+//
+// Every wait is a cancellation point (see scheduler::cancel()): a cancelled
+// fiber leaves the queue it waited in before fiber_cancelled unwinds it.
+//
+// The wake-ups ride on the scheduler's direct hand-off: a fiber that makes a
+// receiver ready and then parks on its own receive switches straight to it,
+// so a pipeline of fibers over channels runs without a system call.
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// A fiber parked on a primitive, on the fiber's own stack.
+struct fiber_waiter {
+  jmp_buf_link* fiber = g_current_context;
+  fiber_waiter* next = nullptr;
+  bool granted = false;
+
+  // A cancellation point: if the fiber is cancelled before it is granted
+  // anything, it takes itself out of q and throws fiber_cancelled.
+  void wait(intrusive_queue<fiber_waiter, &fiber_waiter::next>& q) {
+      auto& sched = scheduler::local();
+      try {
+          while (!granted) {
+              cancellation_point();
+              sched.park();
+          }
+      } catch (...) {
+          q.remove(*this);
+          throw;
+      }
+  }
+
+  void grant() {
+      granted = true;
+      scheduler::local().wake(*fiber);
+  }
+};
+
+using fiber_wait_queue = intrusive_queue<fiber_waiter, &fiber_waiter::next>;
+
+class fiber_mutex {
+  bool _locked = false;
+  fiber_wait_queue _waiters;
+
+  friend class fiber_condition_variable;
+
+public:
+  fiber_mutex() = default;
+  fiber_mutex(const fiber_mutex&) = delete;
+  fiber_mutex& operator=(const fiber_mutex&) = delete;
+
+  bool try_lock() {
+      return !std::exchange(_locked, true);
+  }
+
+  void lock() {
+      if (try_lock()) {
+          return;
+      }
+      pinned<fiber_waiter> w;
+      _waiters.push_back(*w);
+      w->wait(_waiters);
+  }
+
+  // Hands the mutex to the longest waiting fiber, if any.
+  void unlock() {
+      assert(_locked);
+      if (auto w = _waiters.pop_front()) {
+          w->grant();
+      } else {
+          _locked = false;
+      }
+  }
+};
+
+class fiber_condition_variable {
+  fiber_wait_queue _waiters;
+  fiber_mutex* _mutex = nullptr; // of the current waiters
+
+public:
+  fiber_condition_variable() = default;
+  fiber_condition_variable(const fiber_condition_variable&) = delete;
+  fiber_condition_variable& operator=(const fiber_condition_variable&) = delete;
+
+  // Releases m, waits for a notification and returns with m locked again,
+  // also when it throws fiber_cancelled.
+  void wait(fiber_mutex& m) {
+      assert(!_mutex || _mutex == &m);
+      _mutex = &m;
+      pinned<fiber_waiter> w;
+      _waiters.push_back(*w);
+      m.unlock();
+      try {
+          w->wait(_waiters);
+      } catch (...) {
+          // Notified already and queued for the mutex, possibly.
+          m._waiters.remove(*w);
+          if (_waiters.empty()) {
+              _mutex = nullptr;
+          }
+          m.lock();
+          throw;
+      }
+  }
+
+  template <typename Pred>
+  void wait(fiber_mutex& m, Pred pred) {
+      while (!pred()) {
+          wait(m);
+      }
+  }
+
+  void notify_one() {
+      if (auto w = _waiters.pop_front()) {
+          requeue(*w);
+      }
+  }
+
+  void notify_all() {
+      while (auto w = _waiters.pop_front()) {
+          requeue(*w);
+      }
+  }
+
+private:
+  // The waiter is granted the mutex rather than the notification: it
+  // stays parked until the mutex is free.
+  void requeue(fiber_waiter& w) {
+      auto& m = *_mutex;
+      if (_waiters.empty()) {
+          _mutex = nullptr;
+      }
+      if (m.try_lock()) {
+          w.grant();
+      } else {
+          m._waiters.push_back(w);
+      }
+  }
+};
+
+class fiber_semaphore {
+  struct waiter : fiber_waiter {
+    size_t units;
+  };
+
+  size_t _count;
+  fiber_wait_queue _waiters;
+
+public:
+  explicit fiber_semaphore(size_t count) : _count(count) {}
+  fiber_semaphore(const fiber_semaphore&) = delete;
+  fiber_semaphore& operator=(const fiber_semaphore&) = delete;
+
+  size_t available() const { return _count; }
+  size_t waiters() const { return _waiters.size(); }
+
+  // Waiters are served in order, so a large request is not starved by a
+  // stream of small ones.
+  bool try_wait(size_t units = 1) {
+      if (_waiters.empty() && _count >= units) {
+          _count -= units;
+          return true;
+      }
+      return false;
+  }
+
+  void wait(size_t units = 1) {
+      if (try_wait(units)) {
+          return;
+      }
+      pinned<waiter> w;
+      w->units = units;
+      _waiters.push_back(*w);
+      try {
+          w->wait(_waiters);
+      } catch (...) {
+          // The waiters behind may fit now.
+          signal(0);
+          throw;
+      }
+  }
+
+  void signal(size_t units = 1) {
+      _count += units;
+      while (!_waiters.empty()) {
+          auto& w = static_cast<waiter&>(*_waiters.front());
+          if (_count < w.units) {
+              break;
+          }
+          _count -= w.units;
+          _waiters.pop_front();
+          w.grant();
+      }
+  }
+};
+
+// Bounded multi-producer multi-consumer channel. A capacity of 0 makes
+// every send() wait for a receiver.
+template <typename T>
+class channel {
+  struct waiter : fiber_waiter {
+    std::optional<T> item; // what a sender sends, or a receiver receives
+    bool closed = false;
+  };
+
+  const size_t _capacity;
+  std::unique_ptr<std::optional<T>[]> _items;
+  size_t _head = 0;
+  size_t _size = 0;
+  fiber_wait_queue _senders;   // only while the buffer is full
+  fiber_wait_queue _receivers; // only while the buffer is empty
+  bool _closed = false;
+
+public:
+  explicit channel(size_t capacity)
+      : _capacity(capacity), _items(new std::optional<T>[std::max<size_t>(capacity, 1)]) {}
+  channel(const channel&) = delete;
+  channel& operator=(const channel&) = delete;
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+  bool closed() const { return _closed; }
+
+  // Returns false, without sending, once the channel is closed.
+  bool send(T value) {
+      if (_closed) {
+          return false;
+      }
+      if (auto r = pop_waiter(_receivers)) {
+          r->item.emplace(std::move(value));
+          r->grant();
+          return true;
+      }
+      if (_size < _capacity) {
+          push(std::move(value));
+          return true;
+      }
+      pinned<waiter> w;
+      w->item.emplace(std::move(value));
+      _senders.push_back(*w);
+      w->wait(_senders);
+      return !w->closed;
+  }
+
+  // Returns nullopt once the channel is closed and drained.
+  std::optional<T> receive() {
+      if (_size) {
+          auto& slot = _items[_head];
+          std::optional<T> v(std::move(*slot));
+          slot.reset();
+          _head = (_head + 1) % _capacity;
+          _size--;
+          if (auto s = pop_waiter(_senders)) {
+              push(std::move(*s->item));
+              s->grant();
+          }
+          return v;
+      }
+      if (auto s = pop_waiter(_senders)) {
+          std::optional<T> v(std::move(s->item));
+          s->grant();
+          return v;
+      }
+      if (_closed) {
+          return std::nullopt;
+      }
+      pinned<waiter> w;
+      _receivers.push_back(*w);
+      w->wait(_receivers);
+      return std::move(w->item);
+  }
+
+  // Wakes every waiting fiber: senders fail, receivers get what is still
+  // buffered and then nullopt.
+  void close() {
+      _closed = true;
+      while (auto w = pop_waiter(_senders)) {
+          w->closed = true;
+          w->grant();
+      }
+      while (auto w = pop_waiter(_receivers)) {
+          w->closed = true;
+          w->grant();
+      }
+  }
+
+private:
+  static waiter* pop_waiter(fiber_wait_queue& q) {
+      return static_cast<waiter*>(q.pop_front());
+  }
+
+  void push(T value) {
+      _items[(_head + _size) % _capacity].emplace(std::move(value));
+      _size++;
+  }
+};
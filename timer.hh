@@ -0,0 +1,309 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Fiber timers.
+//
+// Every scheduler thread has a hierarchical timing wheel: four levels of 256
+// slots, level l covering 256^l ticks of one millisecond per slot. A timer
+// goes into the lowest level whose span still reaches its deadline, and
+// moves down a level whenever the wheel turns past the slot it sits in, so
+// adding and cancelling a timer are O(1) and firing costs O(1) per timer
+// and level. Deadlines are rounded up to the next tick; timers further out
+// than the wheel reaches (about 49 days) wait in the top level and are
+// placed again when it turns.
+//
+// The wheel is a poller of the thread's scheduler: it reads the clock when
+// the ready queue runs dry and every 64 polls otherwise. sleep_for(),
+// sleep_until() and park_until() park the calling fiber on a timer; the
+// reactor sleeps until the next deadline when there is nothing to run.
+// Like the scheduler, the wheel is not for the fibers of a
+// work_stealing_scheduler.
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+struct timer {
+  using clock = std::chrono::steady_clock;
+
+  clock::time_point deadline;
+  void (*expire)(timer*) = nullptr;
+  uint64_t tick = 0; // the deadline in wheel ticks
+  timer* next = nullptr;
+  timer* prev = nullptr; // nullptr when not armed
+
+  bool armed() const { return prev != nullptr; }
+};
+
+class timer_wheel final : public poller {
+public:
+  using clock = timer::clock;
+  static constexpr auto tick_duration = std::chrono::milliseconds(1);
+
+private:
+  static constexpr unsigned levels = 4;
+  static constexpr unsigned slot_bits = 8;
+  static constexpr unsigned slots = 1u << slot_bits;
+  static constexpr uint64_t span = uint64_t(1) << (slot_bits * levels);
+  static constexpr unsigned check_interval = 64;
+
+  // A slot is a circular list through its head; a timer is armed while it
+  // is on one.
+  struct level {
+    std::array<timer, slots> heads;
+    std::array<uint64_t, slots / 64> occupied = {};
+  };
+
+  std::array<level, levels> _levels;
+  const clock::time_point _epoch = clock::now();
+  uint64_t _now = 0; // every timer due at or before this tick has fired
+  size_t _armed = 0;
+  unsigned _polls = 0;
+
+public:
+  timer_wheel() {
+      for (auto& l : _levels) {
+          for (auto& h : l.heads) {
+              h.next = h.prev = &h;
+          }
+      }
+      scheduler::local().add_poller(this);
+  }
+
+  ~timer_wheel() {
+      scheduler::local().remove_poller(this);
+  }
+
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  static timer_wheel& local() {
+      static thread_local timer_wheel wheel;
+      return wheel;
+  }
+
+  size_t armed() const { return _armed; }
+
+  // Arms t to call t.expire(&t) from a poll at or after the deadline.
+  void add(timer& t, clock::time_point deadline) {
+      assert(!t.armed());
+      t.deadline = deadline;
+      t.tick = std::max(to_tick(deadline), _now + 1);
+      place(t);
+      _armed++;
+  }
+
+  // Disarms t; a no-op when it has fired or was never armed.
+  void cancel(timer& t) {
+      if (!t.armed()) {
+          return;
+      }
+      unlink(t);
+      _armed--;
+  }
+
+  // Fires every timer due by now. Returns how many fired.
+  size_t advance(clock::time_point now) {
+      size_t fired = 0;
+      auto target = to_tick_floor(now);
+      while (_now < target) {
+          if (!_armed) {
+              _now = target;
+              break;
+          }
+          auto next = _now + 1;
+          auto index = next & (slots - 1);
+          if (index != 0 && !occupied_from(_levels[0], index)) {
+              // Nothing due before the end of this turn of level 0.
+              _now = std::min(target, next | (slots - 1));
+              continue;
+          }
+          _now = next;
+          cascade();
+          fired += fire(_levels[0].heads[_now & (slots - 1)]);
+      }
+      return fired;
+  }
+
+  // When advance() next has work to do, which may be a cascade that fires
+  // nothing, or nullopt when no timer is armed.
+  std::optional<clock::time_point> next_event() const {
+      if (!_armed) {
+          return std::nullopt;
+      }
+      auto index = (_now + 1) & (slots - 1);
+      auto next = (_now | (slots - 1)) + 1;
+      if (index != 0) {
+          for (auto i = index; i < slots; i++) {
+              if (is_occupied(_levels[0], i)) {
+                  next = (_now & ~uint64_t(slots - 1)) + i;
+                  break;
+              }
+          }
+      }
+      return _epoch + next * tick_duration;
+  }
+
+  bool poll() override {
+      if (!_armed || (++_polls % check_interval && scheduler::local().ready_count())) {
+          return false;
+      }
+      return advance(clock::now()) != 0;
+  }
+
+private:
+  uint64_t to_tick(clock::time_point tp) const {
+      if (tp <= _epoch) {
+          return 0;
+      }
+      return (tp - _epoch + tick_duration - clock::duration(1)) / tick_duration;
+  }
+
+  uint64_t to_tick_floor(clock::time_point tp) const {
+      return tp <= _epoch ? 0 : (tp - _epoch) / tick_duration;
+  }
+
+  static bool is_occupied(const level& l, unsigned i) {
+      return l.occupied[i / 64] & (uint64_t(1) << (i % 64));
+  }
+
+  // Whether any slot from i to the end of the level holds a timer.
+  static bool occupied_from(const level& l, unsigned i) {
+      auto word = i / 64;
+      if (l.occupied[word] & (~uint64_t(0) << (i % 64))) {
+          return true;
+      }
+      for (word++; word < l.occupied.size(); word++) {
+          if (l.occupied[word]) {
+              return true;
+          }
+      }
+      return false;
+  }
+
+  // Level l holds timers that agree with _now on every digit above l.
+  void place(timer& t) {
+      auto tick = std::min(t.tick, _now + span - 1);
+      unsigned l = 0;
+      while (l + 1 < levels && (tick >> (slot_bits * (l + 1))) != (_now >> (slot_bits * (l + 1)))) {
+          l++;
+      }
+      auto i = (tick >> (slot_bits * l)) & (slots - 1);
+      auto& lv = _levels[l];
+      auto& head = lv.heads[i];
+      t.next = &head;
+      t.prev = head.prev;
+      head.prev->next = &t;
+      head.prev = &t;
+      lv.occupied[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  void unlink(timer& t) {
+      t.prev->next = t.next;
+      t.next->prev = t.prev;
+      auto head = t.next;
+      if (head->next == head) {
+          // The slot is empty now: find it from its head to clear its bit.
+          for (auto& lv : _levels) {
+              if (head >= &lv.heads.front() && head <= &lv.heads.back()) {
+                  auto i = head - &lv.heads.front();
+                  lv.occupied[i / 64] &= ~(uint64_t(1) << (i % 64));
+              }
+          }
+      }
+      t.next = t.prev = nullptr;
+  }
+
+  // Called when _now has just moved: every level whose turn is complete
+  // hands the timers of its current slot down, highest level first.
+  void cascade() {
+      unsigned top = 0;
+      while (top + 1 < levels && (_now & ((uint64_t(1) << (slot_bits * (top + 1))) - 1)) == 0) {
+          top++;
+      }
+      for (auto l = top; l > 0; l--) {
+          auto i = (_now >> (slot_bits * l)) & (slots - 1);
+          auto& head = _levels[l].heads[i];
+          while (head.next != &head) {
+              auto& t = *head.next;
+              unlink(t);
+              place(t);
+          }
+      }
+  }
+
+  size_t fire(timer& head) {
+      size_t fired = 0;
+      while (head.next != &head) {
+          auto& t = *head.next;
+          unlink(t);
+          _armed--;
+          fired++;
+          t.expire(&t);
+      }
+      return fired;
+  }
+};
+
+// Wakes the fiber that armed it.
+struct fiber_timer : timer {
+  jmp_buf_link* fiber = g_current_context;
+  bool expired = false;
+
+  fiber_timer() {
+      expire = [] (timer* t) {
+          auto self = static_cast<fiber_timer*>(t);
+          self->expired = true;
+          scheduler::local().wake(*self->fiber);
+      };
+  }
+};
+
+// Called from a fiber: parks it until the deadline has passed. A
+// cancellation point.
+inline void sleep_until(timer::clock::time_point deadline) {
+    pinned<fiber_timer> t;
+    auto& wheel = timer_wheel::local();
+    wheel.add(*t, deadline);
+    auto& sched = scheduler::local();
+    try {
+        while (!t->expired) {
+            cancellation_point();
+            sched.park();
+        }
+    } catch (...) {
+        wheel.cancel(*t);
+        throw;
+    }
+}
+
+template <typename Rep, typename Period>
+void sleep_for(std::chrono::duration<Rep, Period> d) {
+    sleep_until(timer::clock::now() + d);
+}
+
+// Called from a fiber: park() that also returns at the deadline. Returns
+// false if it timed out rather than being woken. Unlike park(), a
+// cancellation point.
+inline bool park_until(timer::clock::time_point deadline) {
+    cancellation_point();
+    pinned<fiber_timer> t;
+    auto& wheel = timer_wheel::local();
+    wheel.add(*t, deadline);
+    scheduler::local().park();
+    wheel.cancel(*t);
+    cancellation_point();
+    return !t->expired;
+}
+
+template <typename Rep, typename Period>
+bool park_for(std::chrono::duration<Rep, Period> d) {
+    return park_until(timer::clock::now() + d);
+}
@@ -0,0 +1,346 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Switch tracing.
+//
+// Build with -DFIBER_TRACE and call tracer::instance().start() to record
+// every switch (enter, leave, hand-off, end), park, wake and steal with
+// its cycle_count() and the fiber it concerns. Each thread writes its own
+// ring of trace events, which only it ever writes, so recording takes no
+// lock: a relaxed load of the tracing flag when off, an event and a
+// release store when on. A ring keeps the latest events_per_thread events,
+// flight-recorder style. Without -DFIBER_TRACE the hooks are empty.
+//
+// write_chrome_json() dumps the rings in the Chrome trace event format,
+// which chrome://tracing and ui.perfetto.dev load: a track per thread with
+// a slice for each stretch a fiber held it, and instant events for the
+// rest. A fiber is named by its fiber_config::name, or the type of its
+// callable, and a number in spawn order, which tells apart the fibers a
+// context address is reused for. Names are interned as fibers are spawned,
+// so a trace may be written long after the strings passed in are gone. The
+// thread's own context, where the scheduler loop and the reactor run, is
+// "scheduler".
+//
+// With trace_config::stack_samples every tick of a fiber_watchdog on the
+// thread also records a backtrace of the running fiber, running from the
+// signal handler through the interrupted code up to the fiber's entry (see
+// MAKE_FRAME()), symbolized only when written out.
+//
+// Dump after stop(): a thread writing while the rings are read may tear
+// the events it overwrites.
+
+#pragma once
+
+#include "counters.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <execinfo.h>
+#include <fmt/core.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+enum class trace_kind : uint8_t {
+  enter,    // to the fiber, from a loop or the thread
+  leave,    // back to the one that entered it
+  hand_off, // to the fiber, from the one before it
+  end,      // off a finished fiber, to the one that entered it
+  park,
+  wake,
+  steal, // taken from another thread's queue
+};
+
+struct trace_config {
+  size_t events_per_thread = size_t(1) << 16; // rounded up to a power of two
+  size_t samples_per_thread = 1024;           // likewise
+  bool stack_samples = false;                 // on fiber_watchdog ticks
+};
+
+inline std::atomic<bool> g_tracing{false};
+
+// Numbers contexts in the order they are initialized, from 1.
+inline std::atomic<uint64_t> g_trace_ids{0};
+
+class tracer {
+public:
+  static constexpr int max_sample_depth = 30;
+
+  // Who an event or a sample is about.
+  struct fiber_id {
+    const void* context = nullptr; // nullptr for the thread's own context
+    const char* name = nullptr;
+    uint64_t number = 0;
+  };
+
+  struct event {
+    uint64_t tick;
+    fiber_id fiber;
+    trace_kind kind;
+  };
+
+  struct stack_sample {
+    uint64_t tick;
+    fiber_id fiber;
+    int depth;
+    void* frames[max_sample_depth];
+  };
+
+private:
+  // A thread's rings. The owning thread writes them and re-sizes them when
+  // it finds a new start(); heads only grow.
+  struct thread_buffer {
+    unsigned thread;
+    uint64_t epoch = 0;
+    std::unique_ptr<event[]> events;
+    size_t event_mask = 0;
+    std::atomic<uint64_t> event_head{0};
+    std::unique_ptr<stack_sample[]> samples;
+    size_t sample_mask = 0;
+    std::atomic<uint64_t> sample_head{0};
+    std::atomic<bool> samples_ready{false}; // for the signal handler
+  };
+
+  std::mutex _mutex;
+  std::vector<std::unique_ptr<thread_buffer>> _threads; // kept past thread exit
+  trace_config _config;
+  std::atomic<uint64_t> _epoch{0};
+  uint64_t _start_tick = 0;
+  uint64_t _stop_tick = 0;
+
+  static thread_buffer*& local() {
+      static thread_local thread_buffer* buffer = nullptr;
+      return buffer;
+  }
+
+public:
+  static tracer& instance() {
+      static tracer t;
+      return t;
+  }
+
+  // Clears the rings, which every thread re-sizes as it next records.
+  void start(const trace_config& config = {}) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      start_tick_calibration();
+      _config = config;
+      _start_tick = cycle_count();
+      _epoch.fetch_add(1, std::memory_order_release);
+      g_tracing.store(true, std::memory_order_release);
+  }
+
+  void stop() {
+      g_tracing.store(false, std::memory_order_release);
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop_tick = cycle_count();
+  }
+
+  bool active() const { return g_tracing.load(std::memory_order_relaxed); }
+
+  // A copy of name that lives as long as the process, one per distinct
+  // name. A thread looks names up in its own cache first, so a name it has
+  // seen before costs a hash lookup and no lock.
+  static const char* intern(std::string_view name) {
+      static thread_local std::unordered_map<std::string_view, const char*> cache;
+      if (auto it = cache.find(name); it != cache.end()) [[likely]] {
+          return it->second;
+      }
+      static std::mutex mutex;
+      static auto names = new std::unordered_set<std::string>(); // never destroyed
+      const char* interned;
+      {
+          std::lock_guard<std::mutex> lock(mutex);
+          interned = names->emplace(name).first->c_str();
+      }
+      cache.emplace(interned, interned);
+      return interned;
+  }
+
+  void record(trace_kind kind, const fiber_id& fiber) {
+      auto b = local();
+      if (!b || b->epoch != _epoch.load(std::memory_order_acquire)) [[unlikely]] {
+          b = attach();
+      }
+      auto head = b->event_head.load(std::memory_order_relaxed);
+      b->events[head & b->event_mask] = event{cycle_count(), fiber, kind};
+      b->event_head.store(head + 1, std::memory_order_release);
+  }
+
+  // Async-signal-safe, given that backtrace() has been called before; a
+  // no-op on a thread that has not recorded an event since start().
+  void record_stack_sample(const fiber_id& fiber) noexcept {
+      auto b = local();
+      if (!b || !b->samples_ready.load(std::memory_order_acquire)) {
+          return;
+      }
+      auto head = b->sample_head.load(std::memory_order_relaxed);
+      auto& s = b->samples[head & b->sample_mask];
+      s.tick = cycle_count();
+      s.fiber = fiber;
+      s.depth = backtrace(s.frames, max_sample_depth);
+      b->sample_head.store(head + 1, std::memory_order_release);
+  }
+
+  void write_chrome_json(std::FILE* out) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto epoch = _epoch.load(std::memory_order_acquire);
+      auto stop_tick = active() ? cycle_count() : _stop_tick;
+      auto scale = ns_per_tick() / 1000;
+      auto us = [&] (uint64_t tick) { return tick > _start_tick ? (tick - _start_tick) * scale : 0.0; };
+      const char* sep = "";
+      auto emit = [&] (const std::string& e) {
+          fmt::print(out, "{}\n{}", sep, e);
+          sep = ",";
+      };
+
+      fmt::print(out, "{{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+      for (auto& b : _threads) {
+          if (b->epoch != epoch) {
+              continue;
+          }
+          auto tid = b->thread;
+          emit(fmt::format("{{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": {}, "
+                           "\"args\": {{\"name\": \"thread {}\"}}}}", tid, tid));
+          auto head = b->event_head.load(std::memory_order_acquire);
+          auto first = head - std::min<uint64_t>(head, b->event_mask + 1);
+          const event* slice = nullptr; // the last switch, which began a slice
+          for (auto i = first; i < head; i++) {
+              auto& e = b->events[i & b->event_mask];
+              if (e.kind <= trace_kind::end) {
+                  if (slice) {
+                      emit(slice_json(*slice, e.tick, tid, us));
+                  }
+                  slice = &e;
+              } else {
+                  emit(fmt::format("{{\"ph\": \"i\", \"s\": \"t\", \"name\": \"{}\", \"pid\": 1, \"tid\": {}, "
+                                   "\"ts\": {:.3f}, \"args\": {{\"fiber\": \"{}\"}}}}",
+                                   kind_name(e.kind), tid, us(e.tick), fiber_name(e.fiber)));
+              }
+          }
+          if (slice && stop_tick > slice->tick) {
+              emit(slice_json(*slice, stop_tick, tid, us));
+          }
+          auto sample_head = b->sample_head.load(std::memory_order_acquire);
+          auto first_sample = sample_head - std::min<uint64_t>(sample_head, b->sample_mask + 1);
+          for (auto i = first_sample; i < sample_head; i++) {
+              auto& s = b->samples[i & b->sample_mask];
+              emit(fmt::format("{{\"ph\": \"i\", \"s\": \"t\", \"name\": \"stack sample\", \"pid\": 1, \"tid\": {}, "
+                               "\"ts\": {:.3f}, \"args\": {{\"fiber\": \"{}\", \"frames\": [{}]}}}}",
+                               tid, us(s.tick), fiber_name(s.fiber), frames_json(s)));
+          }
+      }
+      fmt::print(out, "\n]}}\n");
+  }
+
+private:
+  // Called by the owning thread on its first event since start().
+  thread_buffer* attach() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& b = local();
+      if (!b) {
+          _threads.push_back(std::make_unique<thread_buffer>());
+          b = _threads.back().get();
+          b->thread = _threads.size();
+      }
+      auto events = std::bit_ceil(std::max<size_t>(_config.events_per_thread, 2));
+      if (b->event_mask + 1 != events) {
+          b->events = std::make_unique<event[]>(events);
+          b->event_mask = events - 1;
+      }
+      b->samples_ready.store(false, std::memory_order_release);
+      auto samples = _config.stack_samples ? std::bit_ceil(std::max<size_t>(_config.samples_per_thread, 2)) : 0;
+      if ((samples ? b->sample_mask + 1 : 0) != samples || (samples && !b->samples)) {
+          b->samples = samples ? std::make_unique<stack_sample[]>(samples) : nullptr;
+          b->sample_mask = samples ? samples - 1 : 0;
+      }
+      b->event_head.store(0, std::memory_order_relaxed);
+      b->sample_head.store(0, std::memory_order_relaxed);
+      b->epoch = _epoch.load(std::memory_order_relaxed);
+      b->samples_ready.store(samples != 0, std::memory_order_release);
+      return b;
+  }
+
+  static const char* kind_name(trace_kind kind) {
+      switch (kind) {
+      case trace_kind::enter: return "enter";
+      case trace_kind::leave: return "leave";
+      case trace_kind::hand_off: return "hand_off";
+      case trace_kind::end: return "end";
+      case trace_kind::park: return "park";
+      case trace_kind::wake: return "wake";
+      case trace_kind::steal: return "steal";
+      }
+      return "?";
+  }
+
+  static std::string fiber_name(const fiber_id& fiber) {
+      if (!fiber.context) {
+          return "scheduler";
+      }
+      std::string name;
+      append_escaped(name, fiber.name ? fiber.name : "fiber");
+      return fmt::format("{} #{}", name, fiber.number);
+  }
+
+  // Control characters, which JSON strings may not hold raw, as \u00XX.
+  static void append_escaped(std::string& json, std::string_view s) {
+      for (auto c : s) {
+          if (static_cast<unsigned char>(c) < 0x20) {
+              json += fmt::format("\\u{:04x}", static_cast<unsigned char>(c));
+              continue;
+          }
+          if (c == '"' || c == '\\') {
+              json += '\\';
+          }
+          json += c;
+      }
+  }
+
+  template <typename Us>
+  static std::string slice_json(const event& e, uint64_t end_tick, unsigned tid, Us& us) {
+      return fmt::format("{{\"ph\": \"X\", \"name\": \"{}\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3f}, "
+                         "\"dur\": {:.3f}, \"args\": {{\"via\": \"{}\"}}}}",
+                         fiber_name(e.fiber), tid, us(e.tick), us(end_tick) - us(e.tick), kind_name(e.kind));
+  }
+
+  static std::string frames_json(const stack_sample& s) {
+      std::string json;
+      auto symbols = backtrace_symbols(s.frames, s.depth);
+      for (int i = 0; i < s.depth; i++) {
+          json += i ? ", \"" : "\"";
+          if (symbols) {
+              append_escaped(json, symbols[i]);
+          } else {
+              json += fmt::format("{}", s.frames[i]);
+          }
+          json += '"';
+      }
+      std::free(symbols);
+      return json;
+  }
+};
+
+// The hooks of the context switch, the scheduler and the watchdog, called
+// through fiber_trace() and fiber_trace_stack_sample() of context.hh.
+inline void trace_record([[maybe_unused]] trace_kind kind, [[maybe_unused]] const tracer::fiber_id& fiber) {
+#ifdef FIBER_TRACE
+    if (g_tracing.load(std::memory_order_relaxed)) [[unlikely]] {
+        tracer::instance().record(kind, fiber);
+    }
+#endif
+}
+
+inline void trace_record_stack_sample([[maybe_unused]] const tracer::fiber_id& fiber) {
+#ifdef FIBER_TRACE
+    if (g_tracing.load(std::memory_order_relaxed)) [[unlikely]] {
+        tracer::instance().record_stack_sample(fiber);
+    }
+#endif
+}
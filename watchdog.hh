@@ -0,0 +1,200 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Long-running fiber detection.
+//
+// A cooperative fiber that computes without ever switching starves every
+// other fiber of its thread. fiber_watchdog::install() arms a timer on the
+// calling thread's CPU-time clock that signals the thread ticks_per_slice
+// times per slice. Every context switch resets g_watchdog_ticks, the signal
+// handler counts it up, so it says how long the running fiber has had the
+// CPU for:
+//
+//  - after a slice, maybe_yield() yields: long loops call it as often as
+//    they like, it costs a load and a compare until the slice is over;
+//  - after report_after slices, and again every report_after slices, the
+//    handler writes the fiber's backtrace to stderr, unwinding from the
+//    interrupted code up to the fiber's entry (see MAKE_FRAME()).
+//
+// The clock only runs while the thread does, so a thread sleeping in its
+// reactor is neither woken nor reported, and neither is the thread's own
+// context, where the scheduler loop runs. The kernel only checks CPU-time
+// timers at its scheduler tick, which bounds how precisely a slice ends.
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <execinfo.h>
+#include <mutex>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct watchdog_config {
+  std::chrono::nanoseconds slice = std::chrono::milliseconds(10);
+  unsigned report_after = 10; // slices
+  int signal = SIGRTMIN + 3;
+};
+
+class fiber_watchdog {
+public:
+  static constexpr unsigned ticks_per_slice = 4;
+
+private:
+  struct settings {
+    std::atomic<uint64_t> tick_ns{0};
+    std::atomic<unsigned> report_ticks{0};
+    std::atomic<uint64_t> reports{0};
+    int signal = 0;
+  };
+
+  static settings& global() {
+      static settings s;
+      return s;
+  }
+
+public:
+  // Starts watching the fibers of the calling thread. The first call fixes
+  // the configuration and the signal for the process.
+  static void install(const watchdog_config& config = {}) {
+      static std::once_flag once;
+      std::call_once(once, [&] {
+          auto& s = global();
+          s.tick_ns = config.slice.count() / ticks_per_slice;
+          s.report_ticks = config.report_after * ticks_per_slice;
+          s.signal = config.signal;
+          // The first backtrace() loads the unwinder, which must not
+          // happen in the signal handler.
+          void* frames[1];
+          backtrace(frames, 1);
+          struct sigaction sa = {};
+          sa.sa_sigaction = &on_tick;
+          sa.sa_flags = SA_SIGINFO | SA_RESTART;
+          sigemptyset(&sa.sa_mask);
+          auto r = sigaction(s.signal, &sa, nullptr);
+          throw_system_error_on(r == -1, "sigaction");
+      });
+
+      struct thread_timer {
+        timer_t id;
+
+        thread_timer() {
+            auto& s = global();
+            sigevent sev = {};
+            sev.sigev_notify = SIGEV_THREAD_ID;
+            sev.sigev_signo = s.signal;
+            sev.sigev_notify_thread_id = gettid();
+            auto r = timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &id);
+            throw_system_error_on(r == -1, "timer_create");
+            itimerspec its = {};
+            its.it_interval.tv_sec = s.tick_ns / 1'000'000'000;
+            its.it_interval.tv_nsec = s.tick_ns % 1'000'000'000;
+            its.it_value = its.it_interval;
+            r = timer_settime(id, 0, &its, nullptr);
+            throw_system_error_on(r == -1, "timer_settime");
+        }
+
+        ~thread_timer() {
+            timer_delete(id);
+        }
+      };
+      static thread_local thread_timer timer;
+  }
+
+  // How many times a long-running fiber has been reported.
+  static uint64_t reports() {
+      return global().reports.load(std::memory_order_relaxed);
+  }
+
+private:
+  static void on_tick(int, siginfo_t* info, void*) {
+      auto saved_errno = errno;
+      auto self = g_current_context;
+      if (!self || self == &g_unthreaded_context) {
+          errno = saved_errno;
+          return;
+      }
+      // The kernel checks CPU-time timers at its own tick, which may be
+      // coarser than ours; the expirations it merged count too.
+      auto before = g_watchdog_ticks.load(std::memory_order_relaxed);
+      auto ticks = before + 1 + std::max(info->si_overrun, 0);
+      g_watchdog_ticks.store(ticks, std::memory_order_relaxed);
+      fiber_trace_stack_sample(self);
+      auto& s = global();
+      auto report_ticks = s.report_ticks.load(std::memory_order_relaxed);
+      if (report_ticks && ticks / report_ticks != before / report_ticks) {
+          s.reports.fetch_add(1, std::memory_order_relaxed);
+          report(self, ticks * s.tick_ns.load(std::memory_order_relaxed) / 1'000'000);
+      }
+      errno = saved_errno;
+  }
+
+  // Async-signal-safe apart from backtrace(), which install() has primed.
+  static void report(const jmp_buf_link* fiber, uint64_t ms) {
+      char buf[128];
+      size_t n = 0;
+      auto put = [&] (const char* s) {
+          while (*s && n < sizeof(buf)) {
+              buf[n++] = *s++;
+          }
+      };
+      auto put_hex = [&] (uintptr_t v) {
+          put("0x");
+          for (int shift = 60; shift >= 0; shift -= 4) {
+              if (n < sizeof(buf)) {
+                  buf[n++] = "0123456789abcdef"[(v >> shift) & 0xf];
+              }
+          }
+      };
+      auto put_dec = [&] (uint64_t v) {
+          char digits[20];
+          int i = 0;
+          do {
+              digits[i++] = '0' + v % 10;
+              v /= 10;
+          } while (v);
+          while (i && n < sizeof(buf)) {
+              buf[n++] = digits[--i];
+          }
+      };
+      put("fiber ");
+      put_hex(reinterpret_cast<uintptr_t>(fiber));
+      put(" has run for ");
+      put_dec(ms);
+      put(" ms without switching, backtrace:\n");
+      (void)!write(STDERR_FILENO, buf, n);
+      void* frames[64];
+      auto depth = backtrace(frames, 64);
+      backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+  }
+};
+
+// Whether the running fiber has used up its slice; always false without a
+// fiber_watchdog on the thread.
+inline bool preempt_requested() {
+    return g_watchdog_ticks.load(std::memory_order_relaxed) >= fiber_watchdog::ticks_per_slice;
+}
+
+// Called from a fiber of scheduler.hh: yields once it has used up its
+// slice. Fibers of a work_stealing_scheduler check preempt_requested()
+// and yield through it instead.
+inline void maybe_yield() {
+    if (preempt_requested()) [[unlikely]] {
+        scheduler::local().yield();
+        // A new slice also when nothing else was ready to run.
+        g_watchdog_ticks.store(0, std::memory_order_relaxed);
+    }
+}
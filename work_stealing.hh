@@ -0,0 +1,456 @@
+// Pieces peeked from Seastar by Cloudius Systems, Ltd.
+//
+// Multi-threaded work-stealing fiber scheduler.
+//
+// Fibers are multiplexed over a fixed set of worker threads. Every worker
+// runs its own loop context (its g_unthreaded_context) and keeps ready
+// fibers in a bounded Chase-Lev deque: the owner pushes and pops at the
+// bottom, idle workers steal from the top, trying every other worker before
+// they go to sleep. A fiber woken on a worker goes to that worker's deque
+// and runs there next. A yielded fiber goes back to the bottom too, and its
+// worker then takes the oldest fiber from the top, so that yielding fibers
+// take turns. Fibers spawned or woken from outside the runtime and deque
+// overflow go to a shared injection queue that every worker also polls.
+//
+// A worker that finds more fibers in its deque than the one it takes wakes
+// a sleeping worker to steal them. Pushing costs a fence and a load of the
+// idle count; the shared epoch is only bumped when a worker sleeps.
+//
+// Fibers migrate: after yield(), park() or any other switch a fiber may
+// resume on a different thread. The migration hand-off is safe because a
+// fiber is only published to other workers after its worker has switched
+// off the fiber's stack. Fiber code must not keep references to
+// thread_local state (scheduler::local(), stack_pool::local(), ...) across
+// a switch.
+//
+// Only this scheduler's park(), wake() and yield() work for its fibers. The
+// scheduler of scheduler.hh, and so join_handle, the primitives of sync.hh,
+// the timers of timer.hh and the reactor, belong to one thread and know
+// nothing of these fibers; scheduler::local() asserts on a worker thread.
+//
+// The fiber states are the ones of scheduler.hh, updated atomically. Waking
+// a fiber that is still running leaves a permit behind (its state becomes
+// ready), so a park() that races with wake() returns right away instead of
+// losing the wake-up. A yielded fiber stays running while it is queued, so
+// a permit it has, or gets before it runs again, waits for its next park().
+
+#pragma once
+
+#include "context.hh"
+#include "scheduler.hh"
+#include "stack.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+// Bounded Chase-Lev work-stealing deque, after Lê et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (PPoPP '13).
+template <typename T>
+class chase_lev_deque {
+  const int64_t _mask;
+  std::unique_ptr<std::atomic<T*>[]> _buffer;
+  alignas(64) std::atomic<int64_t> _top{0};
+  alignas(64) std::atomic<int64_t> _bottom{0};
+
+public:
+  // capacity must be a power of two.
+  explicit chase_lev_deque(size_t capacity)
+      : _mask(capacity - 1)
+      , _buffer(new std::atomic<T*>[capacity]) {
+      assert((capacity & _mask) == 0);
+  }
+
+  // Owner only. Fails when the deque is full.
+  bool push(T* x) {
+      auto b = _bottom.load(std::memory_order_relaxed);
+      auto t = _top.load(std::memory_order_acquire);
+      if (b - t > _mask) {
+          return false;
+      }
+      _buffer[b & _mask].store(x, std::memory_order_relaxed);
+      _bottom.store(b + 1, std::memory_order_release);
+      return true;
+  }
+
+  // Owner only: the most recently pushed element.
+  T* pop() {
+      auto b = _bottom.load(std::memory_order_relaxed) - 1;
+      _bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto t = _top.load(std::memory_order_relaxed);
+      if (t > b) {
+          _bottom.store(b + 1, std::memory_order_relaxed);
+          return nullptr;
+      }
+      auto x = _buffer[b & _mask].load(std::memory_order_relaxed);
+      if (t == b) {
+          if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+              x = nullptr;
+          }
+          _bottom.store(b + 1, std::memory_order_relaxed);
+      }
+      return x;
+  }
+
+  // Any thread: the least recently pushed element. May fail spuriously when
+  // racing with another thief or the owner.
+  T* steal() {
+      auto t = _top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto b = _bottom.load(std::memory_order_acquire);
+      if (t >= b) {
+          return nullptr;
+      }
+      auto x = _buffer[t & _mask].load(std::memory_order_relaxed);
+      if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+          return nullptr;
+      }
+      return x;
+  }
+
+  size_t size() const {
+      auto b = _bottom.load(std::memory_order_relaxed);
+      auto t = _top.load(std::memory_order_relaxed);
+      return b > t ? b - t : 0;
+  }
+};
+
+struct work_stealing_config {
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  bool pin_workers = false;   // pin worker i to CPU i
+  size_t deque_capacity = 256; // a power of two
+  size_t steal_attempts = 2;   // sweeps over the other workers before going idle
+};
+
+class work_stealing_scheduler {
+  // How often a worker with local work still looks at the injection queue.
+  static constexpr unsigned injection_poll_interval = 61;
+
+  enum class action : uint8_t {
+    none,
+    yield,
+    park,
+  };
+
+  struct worker {
+    work_stealing_scheduler& runtime;
+    const size_t id;
+    chase_lev_deque<jmp_buf_link> deque;
+    action pending = action::none;
+    unsigned tick = 0;
+    bool yielded = false; // the last fiber yielded: take the next from the top
+    uint64_t rng;
+    std::thread thread;
+
+    worker(work_stealing_scheduler& r, size_t i, size_t capacity)
+        : runtime(r), id(i), deque(capacity), rng(0x9e3779b97f4a7c15ull * (i + 1)) {}
+  };
+
+  static inline thread_local worker* t_worker;
+
+  const work_stealing_config _config;
+  std::vector<std::unique_ptr<worker>> _workers;
+
+  std::mutex _injection_mutex;
+  intrusive_queue<jmp_buf_link, &jmp_buf_link::next> _injection;
+  std::atomic<size_t> _injection_size{0};
+
+  std::mutex _idle_mutex;
+  std::condition_variable _idle_cv;
+  std::atomic<size_t> _idle{0};
+  std::atomic<uint64_t> _work_epoch{0};
+  std::atomic<bool> _stopping{false};
+
+public:
+  explicit work_stealing_scheduler(work_stealing_config config = {})
+      : _config(config) {
+      for (size_t i = 0; i < _config.workers; i++) {
+          _workers.push_back(std::make_unique<worker>(*this, i, _config.deque_capacity));
+      }
+      for (auto& w : _workers) {
+          w->thread = std::thread([this, w = w.get()] { run_worker(*w); });
+      }
+  }
+
+  work_stealing_scheduler(const work_stealing_scheduler&) = delete;
+  work_stealing_scheduler& operator=(const work_stealing_scheduler&) = delete;
+
+  ~work_stealing_scheduler() {
+      stop();
+  }
+
+  size_t workers() const { return _workers.size(); }
+
+  // Makes a new fiber running f(ctx) on the given stack ready. It first runs
+  // on whichever worker picks it up.
+  void spawn(jmp_buf_link* ctx, void* stack, size_t stack_size, void (*f)(void*)) {
+      ctx->initialize(f, ctx, stack, stack_size);
+      ctx->state = fiber_state::ready;
+      push(*ctx);
+  }
+
+  // Makes a parked fiber ready; a fiber that is running keeps a permit that
+  // makes its next park() return immediately. Callable from any thread.
+  void wake(jmp_buf_link& f) {
+      std::atomic_ref<fiber_state> state(f.state);
+      auto s = state.load(std::memory_order_acquire);
+      while (true) {
+          if (s == fiber_state::suspended) {
+              if (state.compare_exchange_weak(s, fiber_state::ready, std::memory_order_acq_rel)) {
+                  fiber_trace(trace_kind::wake, &f);
+                  push(f);
+                  return;
+              }
+          } else if (s == fiber_state::running) {
+              if (state.compare_exchange_weak(s, fiber_state::ready, std::memory_order_acq_rel)) {
+                  return;
+              }
+          } else {
+              return;
+          }
+      }
+  }
+
+  // Called from a fiber of the runtime: requeues it behind the other ready
+  // fibers. It may resume on another worker.
+  static void yield() {
+      switch_to_worker(action::yield);
+  }
+
+  // Called from a fiber of the runtime: suspends it until wake(). It may
+  // resume on another worker.
+  static void park() {
+      switch_to_worker(action::park);
+  }
+
+  // Stops and joins the workers. Fibers that are still queued or parked are
+  // abandoned; the caller owns their stacks.
+  void stop() {
+      if (_stopping.exchange(true)) {
+          return;
+      }
+      {
+          std::lock_guard<std::mutex> lock(_idle_mutex);
+          _work_epoch.fetch_add(1);
+      }
+      _idle_cv.notify_all();
+      for (auto& w : _workers) {
+          w->thread.join();
+      }
+  }
+
+private:
+  // Thread-local state may have been cached by the caller before a switch
+  // moved it to another thread, so look the worker up afresh.
+  [[gnu::noinline]] static worker* current_worker() {
+      return t_worker;
+  }
+
+  static void switch_to_worker(action a) {
+      auto w = current_worker();
+      assert(w && "not running on a work_stealing_scheduler worker");
+      w->pending = a;
+      current_context()->leave();
+  }
+
+  void push(jmp_buf_link& f) {
+      auto w = current_worker();
+      if (!w || &w->runtime != this || !w->deque.push(&f)) {
+          inject(f);
+          return;
+      }
+      notify_idle();
+  }
+
+  // Called by the worker that owns the deque, off the fiber's stack.
+  void push_local(worker& w, jmp_buf_link& f) {
+      if (!w.deque.push(&f)) {
+          inject(f);
+      }
+  }
+
+  void inject(jmp_buf_link& f) {
+      {
+          std::lock_guard<std::mutex> lock(_injection_mutex);
+          _injection.push_back(f);
+          _injection_size.fetch_add(1, std::memory_order_relaxed);
+      }
+      notify_idle();
+  }
+
+  jmp_buf_link* take_injected() {
+      if (_injection_size.load(std::memory_order_relaxed) == 0) {
+          return nullptr;
+      }
+      std::lock_guard<std::mutex> lock(_injection_mutex);
+      auto f = _injection.pop_front();
+      if (f) {
+          _injection_size.fetch_sub(1, std::memory_order_relaxed);
+      }
+      return f;
+  }
+
+  // After making work visible: wakes a worker if one sleeps. Pairs with
+  // the fence in idle(), so either the sleeper sees the work or this sees
+  // the sleeper.
+  void notify_idle() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (_idle.load(std::memory_order_relaxed) > 0) {
+          wake_idle();
+      }
+  }
+
+  // Wakes a worker that sleeps, if any, when there is work left to steal.
+  void notify_surplus(const chase_lev_deque<jmp_buf_link>& deque) {
+      if (_idle.load(std::memory_order_relaxed) > 0 && deque.size() > 0) {
+          wake_idle();
+      }
+  }
+
+  void wake_idle() {
+      {
+          std::lock_guard<std::mutex> lock(_idle_mutex);
+          _work_epoch.fetch_add(1, std::memory_order_relaxed);
+      }
+      _idle_cv.notify_one();
+  }
+
+  bool has_work() const {
+      if (_injection_size.load(std::memory_order_relaxed) > 0) {
+          return true;
+      }
+      return std::any_of(_workers.begin(), _workers.end(), [] (auto& w) { return w->deque.size() > 0; });
+  }
+
+  // Tries every other worker, starting from a random one.
+  jmp_buf_link* steal(worker& w) {
+      auto n = _workers.size();
+      if (n < 2) {
+          return nullptr;
+      }
+      for (size_t round = 0; round < _config.steal_attempts; round++) {
+          w.rng ^= w.rng << 13;
+          w.rng ^= w.rng >> 7;
+          w.rng ^= w.rng << 17;
+          auto start = w.rng % n;
+          for (size_t i = 0; i < n; i++) {
+              auto& victim = *_workers[(start + i) % n];
+              if (&victim == &w) {
+                  continue;
+              }
+              auto f = victim.deque.steal();
+              g_counters.on_steal(f != nullptr);
+              if (f) {
+                  fiber_trace(trace_kind::steal, f);
+                  notify_surplus(victim.deque);
+                  return f;
+              }
+          }
+      }
+      return nullptr;
+  }
+
+  jmp_buf_link* next_fiber(worker& w) {
+      if (++w.tick % injection_poll_interval == 0) {
+          if (auto f = take_injected()) {
+              return f;
+          }
+      }
+      jmp_buf_link* f = nullptr;
+      if (std::exchange(w.yielded, false)) {
+          f = w.deque.steal();
+      }
+      if (f || (f = w.deque.pop())) {
+          notify_surplus(w.deque);
+          return f;
+      }
+      if ((f = take_injected())) {
+          return f;
+      }
+      return steal(w);
+  }
+
+  void run_fiber(worker& w, jmp_buf_link& f) {
+      std::atomic_ref<fiber_state> state(f.state);
+      if (!std::exchange(f.requeued, false)) {
+          assert(state.load(std::memory_order_acquire) == fiber_state::ready);
+          state.store(fiber_state::running, std::memory_order_relaxed);
+      }
+      w.pending = action::none;
+      f.enter();
+
+      // Only now, off the fiber's stack, may other workers see it again.
+      switch (std::exchange(w.pending, action::none)) {
+      case action::yield:
+          // Left running, or ready with a permit, for the next park().
+          f.requeued = true;
+          push_local(w, f);
+          w.yielded = true;
+          break;
+      case action::park: {
+          fiber_trace(trace_kind::park, &f);
+          auto s = fiber_state::running;
+          if (!state.compare_exchange_strong(s, fiber_state::suspended, std::memory_order_acq_rel)) {
+              // Woken while parking.
+              assert(s == fiber_state::ready);
+              push_local(w, f);
+          }
+          break;
+      }
+      case action::none:
+          // Finished through jmp_buf_link::end().
+          break;
+      }
+  }
+
+  // Sleeps until wake_idle() or stop(), unless work has shown up since the
+  // worker last looked.
+  void idle() {
+      std::unique_lock<std::mutex> lock(_idle_mutex);
+      auto epoch = _work_epoch.load(std::memory_order_relaxed);
+      _idle.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!has_work()) {
+          _idle_cv.wait(lock, [&] {
+              return _work_epoch.load(std::memory_order_relaxed) != epoch
+                  || _stopping.load(std::memory_order_relaxed);
+          });
+      }
+      _idle.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void pin(worker& w) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(w.id % CPU_SETSIZE, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  void run_worker(worker& w) {
+      init();
+      guarded_stack_source::install_overflow_handler();
+      g_work_stealing_worker = true;
+      t_worker = &w;
+      if (_config.pin_workers) {
+          pin(w);
+      }
+      while (!_stopping.load(std::memory_order_relaxed)) {
+          if (auto f = next_fiber(w)) {
+              run_fiber(w, *f);
+          } else {
+              idle();
+          }
+      }
+      t_worker = nullptr;
+      g_work_stealing_worker = false;
+  }
+};